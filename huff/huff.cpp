@@ -1,340 +1,427 @@
 //huff.cpp
 //By Jerred Shepherd and Mack Peters
 //This program compresses a file using the huffman algorithm. The file can later be decompressed
-//by the corresponding puff program.
-
+//with huff -d.
 
 #include <iostream>
 #include <fstream>
-#include <map>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <iomanip>
-#include <ctime>
-
-using std::map;
-using std::vector;
-using std::string;
-
-using std::ofstream;
-using std::ifstream;
-using std::ios;
-
-using std::cin;
-using std::cout;
-using std::endl;
-
-struct HuffTableEntry {
-    int glyph = -1;
-    int frequency = 0;
-    int leftPointer = -1;
-    int rightPointer = -1;
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <random>
+#include <cstdio>
+#include <functional>
+
+#include "huffcodec.h"
+
+// Results for one compression level in benchmarkFile
+struct BenchmarkRun {
+    int level;
+    double encodeSeconds = 0;
+    double decodeSeconds = 0;
+    uint64_t compressedSize = 0;
+    bool sampled = false;
+    int sampleStride = 1;
+    double samplingLoss = 0;
+
+    explicit BenchmarkRun(int level) : level(level) {}
 };
 
-struct FileInfo {
-    string fileName;
-    int fileNameLength;
-    ifstream fileStream;
-    double fileStreamLength;
-    int numberOfGlyphsInFile;
-};
-
-// Min heaping
-// Marks current position as smallest, gets left and right children. If left child is not outside the heap
-// compares its frequency to the smallest frequency. If it is smaller, set left child to the smallest. Then does the same
-// with right child. If smallest is not equal to the original position fed in, switch the values for current position and the
-// smallest value. Then re-check (which may be unnecessary...I can't remember why that's there)
-void minHeap(vector<HuffTableEntry> &fileInfo, int position, int heapSize) {
-    int smallest = position;
-    int left = 2 * position + 1;
-    int right = 2 * position + 2;
-
-    if (left <= heapSize && fileInfo[left].frequency < fileInfo[smallest].frequency) {
-        smallest = left;
+//Compresses and decompresses a file in memory at every compression level, checks the round trip, and prints
+//the throughput and size of each. The levels take turns so they all see the same cache and clock conditions.
+void benchmarkFile(const string &fileName) {
+    FileInfo fileInfo;
+    fileInfo.fileName = fileName;
+    fileInfo.fileNameLength = fileName.length();
+    loadFileContents(fileInfo);
+    if (!fileInfo.fileStream || fileInfo.fileStreamLength == 0) {
+        throw std::runtime_error("could not read " + fileName);
     }
-
-    if (right <= heapSize && fileInfo[right].frequency < fileInfo[smallest].frequency) {
-        smallest = right;
+    if (fileInfo.fileStreamLength > SIZE_MAX / 2) {
+        throw std::runtime_error("too big to benchmark in memory");
     }
+    string original((size_t) fileInfo.fileStreamLength, '\0');
+    fileInfo.fileStream.read(&original[0], original.size());
 
-    if (smallest != position) {
-        HuffTableEntry temp = fileInfo[position];
-        fileInfo[position] = fileInfo[smallest];
-        fileInfo[smallest] = temp;
-        minHeap(fileInfo, smallest, heapSize);
+    vector<BenchmarkRun> runs;
+    for (int level = 1; level <= 9; level++) {
+        runs.push_back(BenchmarkRun(level));
     }
-}
 
-//Recursive function that generates byte codes. If the table entry is a merge node (-1 as glyph), we then look for
-//left and right pointers. If the pointer goes left, add a 0 to the byte code, if it goes right, add a 1. Once we hit
-//a leaf node (glyph not -1) then attach the string to that glyph. Stored in a map of <int, string> where the int is the glyph
-//and the string is the bytecode. Ints are necessary because 256 is EOF and cannot be represented as a char.
-void
-generateByteCodes(vector<HuffTableEntry> &treeValues, map<int, string> &byteCodes, int position, string byteCode) {
-    if (treeValues[position].leftPointer != -1 || treeValues[position].rightPointer != -1) {
-        if (treeValues[position].leftPointer != -1) {
-            generateByteCodes(treeValues, byteCodes, treeValues[position].leftPointer, (byteCode + "0"));
-        }
-        if (treeValues[position].rightPointer != -1) {
-            generateByteCodes(treeValues, byteCodes, treeValues[position].rightPointer, (byteCode + "1"));
-        }
-    } else {
-        byteCodes[treeValues[position].glyph] = byteCode;
-    }
-}
+    int repetitions = std::max(1, (int) (4 * 1024 * 1024 / fileInfo.fileStreamLength));
+    double checksumSeconds = 0;
+    double checksumBytes = 0;
+    string payload;
 
-// Sort hufTable by frequency
-bool sortByFrequency(HuffTableEntry &lhs, HuffTableEntry &rhs) {
-    return lhs.frequency < rhs.frequency;
-}
+    for (int i = 0; i < repetitions; i++) {
+        for (BenchmarkRun &run : runs) {
+            applyCompressionLevel(fileInfo, run.level);
 
-//Gets file contents and also determines how big the file is.
-void loadFileContents(FileInfo &fileInfo) {
-    fileInfo.fileStream = ifstream(fileInfo.fileName, ios::in | ios::binary);
+            Stopwatch::time_point start = Stopwatch::now();
+            string data = compressInMemory(fileInfo);
+            run.encodeSeconds += secondsSince(start);
 
-    // Find how long the file is, store that number, and return to the beginning of the file
-    fileInfo.fileStream.seekg(0, fileInfo.fileStream.end);
-    fileInfo.fileStreamLength = fileInfo.fileStream.tellg();
-    fileInfo.fileStream.seekg(0, fileInfo.fileStream.beg);
-}
+            run.compressedSize = data.size();
+            run.sampled = samplesInput(fileInfo);
+            run.sampleStride = fileInfo.sampleStride;
+            run.samplingLoss = fileInfo.stats.samplingLoss;
 
-//Reads through the file and stores how often a glyph appears.
-//Glyphs and values are stored in a map of <int,int>.
-map<int, int> getGlyphFrequencies(FileInfo &fileInfo) {
-    map<int, int> glyphFrequencies;
+            start = Stopwatch::now();
+            string decoded = decompressInMemory(data);
+            run.decodeSeconds += secondsSince(start);
 
-    // Putting values into a map and incrementing repeat offenders
-    for (int i = 0; i < fileInfo.fileStreamLength; i++) {
-        int num = 0;
-        fileInfo.fileStream.read((char *)&num, 1);
-        fileInfo.fileStream.seekg(0, 1);
+            if (decoded != original) {
+                throw std::runtime_error("round trip failed at level " + std::to_string(run.level));
+            }
+            if (run.level == DEFAULT_COMPRESSION_LEVEL) {
+                HufFileHeader header = readHufFileHeader(data, data.size());
+                payload = data.substr(header.payloadOffset, (size_t) header.payloadSize);
+            }
+        }
 
-        glyphFrequencies[num]++;
+        Stopwatch::time_point start = Stopwatch::now();
+        volatile uint32_t checksum = 0;
+        for (int k = 0; k < 16; k++) {
+            checksum ^= crc32c(payload.data(), payload.size());
+        }
+        checksumSeconds += secondsSince(start);
+        checksumBytes += 16.0 * payload.size();
     }
 
-    // Adding the eof character
-    glyphFrequencies[256] = 1;
-
-	//return to beginning of file for later
-	fileInfo.fileStream.seekg(0, ios::beg);
-
-    return glyphFrequencies;
-}
-
-
-// TODO find better fileName
-//Creates a vector of HuffTableEntry to support creating a huffman table later on. Table must be
-//the number of glpyhs in file plus number of glyphs in file minus one to support
-//the huffman algorithm. Vector of correct size is created then we iterate through the map
-//of glyphs and frequencies and add those values to the slots in the array. It then sorts the array from
-//smallest to largest to allow the huffman algorithm to work in a later step.
-vector<HuffTableEntry> createSortedVectorFromFile(FileInfo &fileInfo) {
-    map<int, int> glyphFrequencies = getGlyphFrequencies(fileInfo);
-
-    fileInfo.numberOfGlyphsInFile = glyphFrequencies.size();
-
-    // Creates a vector that's as big as we need so that it can be sorted by value
-    vector<HuffTableEntry> huffTableVector(fileInfo.numberOfGlyphsInFile + (fileInfo.numberOfGlyphsInFile - 1));
-
-    // Put map into vector
-    int arrayLocation = 0;
-    for (auto entry : glyphFrequencies) {
-        huffTableVector[arrayLocation].glyph = entry.first;
-        huffTableVector[arrayLocation].frequency = entry.second;
-        arrayLocation++;
+    double totalBytes = (double) fileInfo.fileStreamLength * repetitions;
+    cout << std::setprecision(1) << std::fixed;
+    cout << fileName << " (" << fileInfo.fileStreamLength << " bytes x " << repetitions << ")" << endl;
+    for (const BenchmarkRun &run : runs) {
+        cout << "  level " << run.level
+             << "  encode " << std::setw(7) << megabytesPerSecond(totalBytes, run.encodeSeconds) << " MB/s"
+             << "  decode " << std::setw(7) << megabytesPerSecond(totalBytes, run.decodeSeconds) << " MB/s"
+             << "  size " << std::setw(6) << 100.0 * run.compressedSize / fileInfo.fileStreamLength << "%"
+             << " (" << run.compressedSize << " bytes)";
+        if (run.sampled) {
+            cout << "  1/" << run.sampleStride << " sampled, +" << std::setprecision(2)
+                 << 100 * run.samplingLoss << "%" << std::setprecision(1);
+        }
+        cout << endl;
     }
+    cout << "  crc32c alone " << megabytesPerSecond(checksumBytes, checksumSeconds) << " MB/s" << endl;
 
-    sort(huffTableVector.begin(), huffTableVector.begin() + fileInfo.numberOfGlyphsInFile, sortByFrequency);
-
-    return huffTableVector;
+    fileInfo.fileStream.close();
 }
 
-//Fills in the huffman table by following steps learned in class. We first mark the end of the heap
-//and the first free slot. Then we mark which of slots 1 and 2 in the vector have the lowest value. We 
-//move the marked lowest value to the first free slot, then move the end of the heap to the empty slot just
-//create by moving the lowest value. We then reheap to ensure that we maintain a min heap. Then we move the 
-//value in slot 0 to the end of the heap, and in slot 0 we create a merge node containing the value just moved
-//from the front of the heap as the left pointer and the value in the first free slot as the right pointer. We
-//reheap once more and then move the end of the heap to the left as to not include the node that was just moved
-//and the first free slot to the right to the next free slot.
-vector<HuffTableEntry> createHuffmanTable(FileInfo &fileInfo) {
-    vector<HuffTableEntry> huffTable = createSortedVectorFromFile(fileInfo);
-
-    // Creating the full huffman table
-    int heapEnd = fileInfo.numberOfGlyphsInFile - 1;
-    int firstFreeSlot = fileInfo.numberOfGlyphsInFile;
-    int marked;
-
-    // Stops 2 early because the last merge doesn't need to be this intense
-    for (int i = 0; i < (fileInfo.numberOfGlyphsInFile - 2); i++) {
-        marked = (huffTable[1].frequency < huffTable[2].frequency) ? 1 : 2;
-        huffTable[firstFreeSlot] = huffTable[marked];
-        huffTable[marked] = huffTable[heapEnd];
-
-        for (int k = (heapEnd - 1) / 2; k >= 0; k--) {
-            minHeap(huffTable, k, heapEnd - 1);
+// Payload sizes benchmarkSmallPayloads times, and how many different payloads of each size it cycles through
+const size_t SMALL_PAYLOAD_SIZES[] = {100, 400, 1024, 4096};
+const int SMALL_PAYLOAD_COUNT = 64;
+
+//Calls per second that call makes, going round the payloads for about a quarter of a second
+double callsPerSecond(const vector<string> &payloads, const std::function<void(const string &)> &call) {
+    Stopwatch::time_point start = Stopwatch::now();
+    uint64_t calls = 0;
+    do {
+        for (const string &payload : payloads) {
+            call(payload);
         }
+        calls += payloads.size();
+    } while (secondsSince(start) < 0.25);
+    return calls / secondsSince(start);
+}
 
-        huffTable[heapEnd] = huffTable[0];
-        huffTable[0].glyph = -1;
-        huffTable[0].frequency = huffTable[heapEnd].frequency + huffTable[firstFreeSlot].frequency;
-        huffTable[0].leftPointer = heapEnd;
-        huffTable[0].rightPointer = firstFreeSlot;
+//Times compress() and decompress() on small made up payloads, as a service compressing messages one at a time
+//would use them, next to the same calls through a HuffContext that's kept from call to call. Prints calls per
+//second for each payload size, and how big the payloads come out next to what went in.
+void benchmarkSmallPayloads() {
+    std::mt19937 random(1);
+    HuffContext context;
+    cout << std::fixed << std::setprecision(0);
+    for (size_t size : SMALL_PAYLOAD_SIZES) {
+        vector<string> payloads;
+        vector<string> compressed;
+        size_t compressedBytes = 0;
+        for (int i = 0; i < SMALL_PAYLOAD_COUNT; i++) {
+            payloads.push_back(randomBytes(random, size, 64, 1.2, 2));
+            string data(compressBound(size), '\0');
+            data.resize(compress((const uint8_t *) payloads.back().data(), size, (uint8_t *) &data[0], data.size()));
+            compressed.push_back(data);
+            compressedBytes += data.size();
+        }
 
-        for (int l = (heapEnd - 1) / 2; l >= 0; l--) {
-            minHeap(huffTable, l, heapEnd - 1);
+        string out(compressBound(size), '\0');
+        double compressCalls = callsPerSecond(payloads, [&](const string &payload) {
+            compress((const uint8_t *) payload.data(), size, (uint8_t *) &out[0], out.size());
+        });
+        double contextCompressCalls = callsPerSecond(payloads, [&](const string &payload) {
+            context.compress((const uint8_t *) payload.data(), size, (uint8_t *) &out[0], out.size());
+        });
+        double decompressCalls = callsPerSecond(compressed, [&](const string &data) {
+            decompress((const uint8_t *) data.data(), data.size(), (uint8_t *) &out[0], out.size());
+        });
+        double contextDecompressCalls = callsPerSecond(compressed, [&](const string &data) {
+            context.decompress((const uint8_t *) data.data(), data.size(), (uint8_t *) &out[0], out.size());
+        });
+        if (out.compare(0, size, payloads.back()) != 0) {
+            throw std::runtime_error("round trip failed at " + std::to_string(size) + " bytes");
         }
 
-        heapEnd--;
-        firstFreeSlot++;
+        cout << std::setw(5) << size << " bytes"
+             << "  size " << std::setw(4) << 100.0 * compressedBytes / (size * SMALL_PAYLOAD_COUNT) << "%"
+             << "  compress " << std::setw(8) << compressCalls << " calls/s, " << std::setw(8) << contextCompressCalls
+             << " with a context"
+             << "  decompress " << std::setw(8) << decompressCalls << " calls/s, " << std::setw(8)
+             << contextDecompressCalls << " with a context" << endl;
     }
-
-    // Last merge
-    huffTable[firstFreeSlot] = huffTable[0];
-    huffTable[0].glyph = -1;
-    huffTable[0].frequency = huffTable[1].frequency + huffTable[firstFreeSlot].frequency;
-    huffTable[0].leftPointer = 1;
-    huffTable[0].rightPointer = firstFreeSlot;
-
-    return huffTable;
-}
-
-//Acts as an entry point to generate the byte codes. Implemented in order to keep other functions more organized
-map<int, string> generateByteCodeTable(vector<HuffTableEntry> &huffTable) {
-    map<int, string> byteCodes;
-    string byteCode;
-
-    generateByteCodes(huffTable, byteCodes, 0, byteCode);
-
-    return byteCodes;
 }
 
-/**
- * Reads through every byte in a file, and encodes it using a map
- * @param fileInfo The fileInfo object to use; contains the bytes to be encoded
- * @param map The map to encode with
- * @return An encoded string of 0's and 1's
- */
-string encodeMessageToStringOfBits(FileInfo &fileInfo, map<int, string> &map) {
-
-    string s = "";
-    for (int i = 0; i < fileInfo.fileStreamLength; i++) {
-        int num = 0;
-        fileInfo.fileStream.read((char *)&num, 1);
-        fileInfo.fileStream.seekg(0, 1);
-
-		s += map[num];
+#ifdef HUFF_FUZZ
+//Entry point for libFuzzer, built as huff_fuzz by configuring CMake with clang and -DHUFF_FUZZ=ON.
+//Whatever the bytes are, they have to decode or be turned away with a runtime_error.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *bytes, size_t size) {
+    try {
+        decompressInMemory(string((const char *) bytes, size));
+    } catch (const std::runtime_error &) {
     }
-
-    // Add the eof character
-	s += map[256];
-
-    return s;
+    return 0;
 }
-
-/**
- * Encodes a single byte
- * @param byte A string of 8 bits
- * @return A byte
- */
-unsigned char encodeByte(string byte) {
-    // byte to be encoded
-    unsigned char byte1 = '\0';
-    // length of huffman code
-    int bitstringLength = byte.length();
-
-    // building an encoded byte from right to left
-    int cnt = 0;
-    for (int i = 0; i < bitstringLength; i++) {
-        // is the bit "on"?
-        if (byte[i] == '1')
-            // turn the bit on using the OR bitwise operator
-            byte1 = byte1 | (int) pow(2.0, cnt);
-        cnt++;
+#else
+//Reads an option's value from text: a whole number from minimum to maximum. Returns false for anything else,
+//including a number too big to hold, rather than the wrapped or clamped value atoi and strtoull would give.
+bool parseOptionValue(const char *text, uint64_t minimum, uint64_t maximum, uint64_t &value) {
+    if (!isdigit((unsigned char) text[0])) {
+        return false;
+    }
+    errno = 0;
+    char *end;
+    unsigned long long number = std::strtoull(text, &end, 10);
+    if (errno == ERANGE || *end != '\0' || number < minimum || number > maximum) {
+        return false;
     }
-    return byte1;
+    value = number;
+    return true;
 }
 
-/**
- * Takes a string of bits and converts it to a string of bytes
- * @param message A string of bits
- */
-string encodeMessageToStringOfBytes(string &message) {
-    string bytes;
-    for (unsigned i = 0; i < message.length(); i += 8) {
-
-        string newMessage = message.substr(i, 8);
-        if (newMessage.length() < 8 && newMessage.length() > 0) {
-            int numberNeeded = 8 - newMessage.length();
-            for (int x = 0; x < numberNeeded; x++) {
-                newMessage += "0";
+//Usage:
+//  huff [-1 .. -9] [-s blockKB] [-p n] [fileName]   compress; -1 is fastest, -9 smallest, -5 the default,
+//                                                   -p n builds the table from one 4 KB piece in every n
+//  huff [-1 .. -9] [-s blockKB] [-p n] -m fileName...  compress many files, several at a time
+//  huff -d [fileName.huf] [outputName]              decompress
+//  huff -x fileName.huf offset length [outputName]  decompress just part of the file (to the console by default)
+//  huff analyze [-1 .. -9] [-s blockKB] fileName...  predict how well files compress, from their byte counts
+//  huff tables fileName.huf [outputName]            dump every table with its glyph counts and codes, as JSON
+//                                                   (to the console by default), or CSV for a .csv outputName
+//  huff -b fileName...                              benchmark; with no files, calls per second on small payloads
+//  huff --max-memory MB [-d] ...                    compress or decompress in about MB megabytes or less: with
+//                                                   fewer threads and smaller blocks, or a block at a time
+//  huff --pin [-1 .. -9] fileName                   keep each encoder thread on a core of its own, when the
+//                                                   process has exactly one core for each thread; not with -m,
+//                                                   whose files share the cores out between them
+//Asks for the file name when it isn't given on the command line.
+int main(int argc, char *argv[]) {
+
+    bool decompress = false;
+    bool extract = false;
+    bool many = false;
+    bool analyze = false;
+    int level = DEFAULT_COMPRESSION_LEVEL;
+    size_t blockSize = 0;
+    int sampleStride = 0;
+    uint64_t maxMemory = 0;
+    bool pinWorkers = false;
+    string fileName;
+    string outputName;
+
+    int arg = 1;
+    if (arg < argc && string(argv[arg]) == "-b") {
+        if (arg + 1 == argc) {
+            benchmarkSmallPayloads();
+            return 0;
+        }
+        try {
+            for (arg++; arg < argc; arg++) {
+                benchmarkFile(argv[arg]);
             }
+        } catch (const std::runtime_error &e) {
+            cerr << argv[arg] << ": " << e.what() << endl;
+            return 1;
         }
-
-		bytes += encodeByte(newMessage);
+        return 0;
     }
-
-    return bytes;
-}
-
-//Creates the .huf version of the file.
-//First writes out the file name length, the file name itself, and then the number of table entries. It then
-//loops through the huffman table and prints out each glyph, left and right pointer in each slot. Lastly, it
-//writes out the entire compressed message.
-void createAndOutputFileInfo(FileInfo &fileInfo, vector<HuffTableEntry> &huffTableEntries, string &bytes) {
-    // Strips away any extension from filename. If there isn't one, then just creates
-    // a copy of the original filename.
-    int pos = fileInfo.fileName.find_last_of(".");
-    string fileNameWithoutExtension = fileInfo.fileName.substr(0, pos);
-
-    ofstream fout(fileNameWithoutExtension + ".huf", ios::out | ios::binary);
-
-    int numberOfTableEntries = huffTableEntries.size();
-
-    fout.write((char *) &fileInfo.fileNameLength, sizeof fileInfo.fileNameLength);
-    fout.write(fileInfo.fileName.c_str(), fileInfo.fileName.size());
-    fout.write((char *) &numberOfTableEntries, sizeof numberOfTableEntries);
-
-    for (int i = 0; i < numberOfTableEntries; i++) {
-        fout.write((char *) &huffTableEntries[i].glyph, sizeof huffTableEntries[i].glyph);
-        fout.write((char *) &huffTableEntries[i].leftPointer, sizeof huffTableEntries[i].leftPointer);
-        fout.write((char *) &huffTableEntries[i].rightPointer, sizeof huffTableEntries[i].rightPointer);
+    if (arg < argc && string(argv[arg]) == "tables") {
+        if (arg + 1 >= argc) {
+            cerr << "usage: huff tables fileName.huf [outputName]" << endl;
+            return 1;
+        }
+        fileName = argv[arg + 1];
+        outputName = arg + 2 < argc ? argv[arg + 2] : "";
+        bool csv = outputName.size() >= 4 && outputName.compare(outputName.size() - 4, 4, ".csv") == 0;
+        try {
+            if (outputName.empty()) {
+                dumpTables(fileName, cout, csv);
+            } else {
+                ofstream fout(outputName, ios::out | ios::binary);
+                dumpTables(fileName, fout, csv);
+            }
+        } catch (const std::runtime_error &e) {
+            cerr << fileName << ": " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (arg < argc && string(argv[arg]) == "analyze") {
+        analyze = true;
+        arg++;
+    }
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        string option = argv[arg];
+        if (option == "-d") {
+            decompress = true;
+        } else if (option == "-x") {
+            extract = true;
+        } else if (option == "-m") {
+            many = true;
+        } else if (option.size() == 2 && option[1] >= '1' && option[1] <= '9') {
+            level = option[1] - '0';
+        } else if (option == "-s") {
+            uint64_t kilobytes;
+            if (arg + 1 >= argc || !parseOptionValue(argv[++arg], 1, MAX_BLOCK_SIZE / 1024, kilobytes)) {
+                cerr << "-s takes a block size of 1 to " << MAX_BLOCK_SIZE / 1024 << " KB" << endl;
+                return 1;
+            }
+            blockSize = (size_t) kilobytes * 1024;
+        } else if (option == "-p") {
+            uint64_t stride;
+            if (arg + 1 >= argc || !parseOptionValue(argv[++arg], 1, INT32_MAX, stride)) {
+                cerr << "-p n samples one piece in every n, for n from 1 to " << INT32_MAX << endl;
+                return 1;
+            }
+            sampleStride = (int) stride;
+        } else if (option == "--pin") {
+            pinWorkers = true;
+        } else if (option == "--max-memory") {
+            // There has to be some room left over BASE_MEMORY, and the limit in bytes has to fit in 64 bits
+            uint64_t megabytes;
+            if (arg + 1 >= argc || !parseOptionValue(argv[++arg], (BASE_MEMORY >> 20) + 1, UINT64_MAX >> 20, megabytes)) {
+                cerr << "--max-memory takes a number of MB from " << (BASE_MEMORY >> 20) + 1 << " to "
+                     << (UINT64_MAX >> 20) << endl;
+                return 1;
+            }
+            maxMemory = (megabytes << 20) - BASE_MEMORY;
+        } else {
+            cerr << "unknown option " << option << endl;
+            return 1;
+        }
     }
 
-    fout.write(bytes.c_str(), bytes.size());
-
-    fout.close();
-
-}
-
-void main() {
+    if (extract) {
+        if (arg + 3 > argc) {
+            cerr << "usage: huff -x fileName.huf offset length [outputName]" << endl;
+            return 1;
+        }
+        fileName = argv[arg];
+        // The range is decoded in memory, so its length has to fit in a size_t; it's clipped to the file anyway
+        uint64_t offset;
+        uint64_t length;
+        if (!parseOptionValue(argv[arg + 1], 0, UINT64_MAX, offset) ||
+            !parseOptionValue(argv[arg + 2], 0, SIZE_MAX, length)) {
+            cerr << "-x takes an offset of 0 to " << UINT64_MAX << " and a length of 0 to " << SIZE_MAX << " bytes"
+                 << endl;
+            return 1;
+        }
+        try {
+            string range = decodeRange(fileName, offset, length);
+            if (arg + 3 < argc) {
+                ofstream fout(argv[arg + 3], ios::out | ios::binary);
+                fout.write(range.data(), range.size());
+            } else {
+                cout.write(range.data(), range.size());
+            }
+        } catch (const std::exception &e) {
+            cerr << fileName << ": " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
 
-    string fileName;
-    cout << "Enter the fileName of a file to be read: ";
-    getline(cin, fileName);
+    auto setUp = [&](FileInfo &fileInfo) {
+        applyCompressionLevel(fileInfo, level);
+        fileInfo.tableCache = &sharedTableCache();
+        if (blockSize > 0) {
+            fileInfo.blockSize = blockSize;
+        }
+        if (sampleStride > 0) {
+            fileInfo.sampleStride = sampleStride;
+        }
+        fileInfo.maxMemory = maxMemory;
+        fileInfo.pinWorkers = pinWorkers;
+    };
 
-	clock_t start, end;
-	start = clock();
+    if (analyze) {
+        return analyzeFiles(vector<string>(argv + arg, argv + argc), setUp) == 0 ? 0 : 1;
+    }
 
-    FileInfo fileInfo;
-    fileInfo.fileName = fileName;
-    fileInfo.fileNameLength = fileName.length();
+    if (many) {
+        if (pinWorkers) {
+            cerr << "--pin doesn't go with -m: files compressed at once would pin their threads to the same cores"
+                 << endl;
+            return 1;
+        }
+        Stopwatch::time_point start = Stopwatch::now();
+        int failures = compressFiles(vector<string>(argv + arg, argv + argc), setUp);
+        cout << std::setprecision(1) << std::fixed;
+        cout << "The time was " << secondsSince(start) << " seconds." << endl;
+        return failures == 0 ? 0 : 1;
+    }
 
-    loadFileContents(fileInfo);
-    vector<HuffTableEntry> huffTable = createHuffmanTable(fileInfo);
-    map<int, string> encodingMap = generateByteCodeTable(huffTable);
+    if (arg < argc) {
+        fileName = argv[arg++];
+    }
+    if (arg < argc) {
+        outputName = argv[arg++];
+    }
 
-    string message = encodeMessageToStringOfBits(fileInfo, encodingMap);
+    if (fileName.empty()) {
+        cout << (decompress ? "Enter the fileName of a file to be decompressed: " : "Enter the fileName of a file to be read: ");
+        getline(cin, fileName);
+    }
 
-    string bytes = encodeMessageToStringOfBytes(message);
+	Stopwatch::time_point start = Stopwatch::now();
 
-    createAndOutputFileInfo(fileInfo, huffTable, bytes);
+    if (decompress) {
+        try {
+            decompressFile(fileName, outputName, maxMemory);
+        } catch (const std::runtime_error &e) {
+            cerr << fileName << ": " << e.what() << endl;
+            return 1;
+        }
+        cout << "Peak memory was " << (peakResidentMemory() >> 20) << " MB." << endl;
+    } else {
+        FileInfo fileInfo;
+        fileInfo.fileName = fileName;
+        fileInfo.fileNameLength = fileName.length();
+        setUp(fileInfo);
+        try {
+            compressFile(fileInfo);
+        } catch (const std::runtime_error &e) {
+            cerr << fileName << ": " << e.what() << endl;
+            return 1;
+        }
 
-    fileInfo.fileStream.close();
+        if (samplesInput(fileInfo)) {
+            cout << std::setprecision(2) << std::fixed;
+            cout << "The table was built from " << fileInfo.stats.sampledBytes << " of " << fileInfo.fileStreamLength
+                 << " bytes, costing " << 100 * fileInfo.stats.samplingLoss << "% over an exact table." << endl;
+        }
+        cout << "Peak memory was " << (fileInfo.stats.peakMemory >> 20) << " MB." << endl;
+    }
 
-	end = clock();
 	cout << std::setprecision(1) << std::fixed;
-	cout << "The time was " << (double(end - start) / CLOCKS_PER_SEC) << " seconds." << endl;
+	cout << "The time was " << secondsSince(start) << " seconds." << endl;
 
-}
\ No newline at end of file
+    return 0;
+}
+#endif
@@ -0,0 +1,48 @@
+//huff.h
+//Compresses and restores data that is already in memory, with the same format and compression levels as the
+//huff program. Errors are thrown as std::runtime_error. Link the huffcodec library (huffcodec.cpp) to use it.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// The level used when none is given, as with no -1 .. -9 on the command line
+const int DEFAULT_COMPRESSION_LEVEL = 5;
+
+// How big the output of compress() can get for length bytes of input, at any level
+size_t compressBound(size_t length);
+
+// Compresses length bytes at in into out, which has room for capacity bytes, at level 1 (fastest) to 9
+// (smallest). Returns the size of the compressed data. Throws when out is too small; compressBound(length)
+// bytes are always enough.
+size_t compress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity,
+                int level = DEFAULT_COMPRESSION_LEVEL);
+
+// The size of the original data, from the header of compressed data
+uint64_t decompressedSize(const uint8_t *in, size_t length);
+
+// Restores the length bytes of compressed data at in into out, which has room for capacity bytes. Returns the
+// size of the original data. Throws when the data is damaged or out is too small.
+size_t decompress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity);
+
+// Working memory for compressing or decompressing one buffer after another, for callers with a great many small
+// ones: the counts, tables, codes and buffers of one call are kept and reused by the next, where the functions
+// above set all of them up again every time. Use a context from one thread at a time.
+class HuffContext {
+public:
+    explicit HuffContext(int level = DEFAULT_COMPRESSION_LEVEL);
+    ~HuffContext();
+
+    HuffContext(const HuffContext &) = delete;
+    HuffContext &operator=(const HuffContext &) = delete;
+
+    // The same as compress() at the context's level, and decompress()
+    size_t compress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity);
+    size_t decompress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity);
+
+private:
+    struct Scratch;
+    std::unique_ptr<Scratch> scratch;
+};
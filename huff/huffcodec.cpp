@@ -0,0 +1,3998 @@
+//huffcodec.cpp
+//By Jerred Shepherd and Mack Peters
+//The huffman codec behind huff.h and the huff program: tables, and encoding and decoding .huf files on disk
+//and in memory.
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <iomanip>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+#include <cmath>
+#include <list>
+#include <unordered_map>
+#include <random>
+#include <cstdio>
+#include <cerrno>
+#include <functional>
+#include <exception>
+
+#include "huffcodec.h"
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define HUFF_HAVE_CRC32_INSTRUCTION
+#define HUFF_TARGET_SSE42
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define HUFF_HAVE_CRC32_INSTRUCTION
+#define HUFF_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#define HUFF_HAVE_MAPPED_FILES
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#define HUFF_HAVE_MAPPED_FILES
+#endif
+
+// Min heaping
+// Marks current position as smallest, gets left and right children. If left child is not outside the heap
+// compares its frequency to the smallest frequency. If it is smaller, set left child to the smallest. Then does the same
+// with right child. If smallest is not equal to the original position fed in, switch the values for current position and the
+// smallest value. Then re-check (which may be unnecessary...I can't remember why that's there)
+void minHeap(vector<HuffTableEntry> &fileInfo, int position, int heapSize) {
+    int smallest = position;
+    int left = 2 * position + 1;
+    int right = 2 * position + 2;
+
+    if (left <= heapSize && fileInfo[left].frequency < fileInfo[smallest].frequency) {
+        smallest = left;
+    }
+
+    if (right <= heapSize && fileInfo[right].frequency < fileInfo[smallest].frequency) {
+        smallest = right;
+    }
+
+    if (smallest != position) {
+        HuffTableEntry temp = fileInfo[position];
+        fileInfo[position] = fileInfo[smallest];
+        fileInfo[smallest] = temp;
+        minHeap(fileInfo, smallest, heapSize);
+    }
+}
+
+//Recursive function that generates byte codes. If the table entry is a merge node (-1 as glyph), we then look for
+//left and right pointers. If the pointer goes left, add a 0 to the byte code, if it goes right, add a 1. Once we hit
+//a leaf node (glyph not -1) then attach the string to that glyph. Stored in a map of <int, string> where the int is the glyph
+//and the string is the bytecode. Ints are necessary because 256 is EOF and cannot be represented as a char.
+void
+generateByteCodes(vector<HuffTableEntry> &treeValues, map<int, string> &byteCodes, int position, string byteCode) {
+    if (treeValues[position].leftPointer != -1 || treeValues[position].rightPointer != -1) {
+        if (treeValues[position].leftPointer != -1) {
+            generateByteCodes(treeValues, byteCodes, treeValues[position].leftPointer, (byteCode + "0"));
+        }
+        if (treeValues[position].rightPointer != -1) {
+            generateByteCodes(treeValues, byteCodes, treeValues[position].rightPointer, (byteCode + "1"));
+        }
+    } else {
+        byteCodes[treeValues[position].glyph] = byteCode;
+    }
+}
+
+// Sort hufTable by frequency
+bool sortByFrequency(HuffTableEntry &lhs, HuffTableEntry &rhs) {
+    return lhs.frequency < rhs.frequency;
+}
+
+//Gets file contents and also determines how big the file is.
+void loadFileContents(FileInfo &fileInfo) {
+    fileInfo.fileStream = ifstream(fileInfo.fileName, ios::in | ios::binary);
+
+    // Find how long the file is, store that number, and return to the beginning of the file
+    fileInfo.fileStream.seekg(0, fileInfo.fileStream.end);
+    std::streamoff length = fileInfo.fileStream.tellg();
+    fileInfo.fileStreamLength = length > 0 ? (uint64_t) length : 0;
+    fileInfo.fileStream.seekg(0, fileInfo.fileStream.beg);
+}
+
+//Adds the number of times each byte value appears in data to counts (256 entries)
+void countBytes(const char *data, size_t length, vector<uint64_t> &counts) {
+    for (size_t i = 0; i < length; i++) {
+        counts[(unsigned char) data[i]]++;
+    }
+}
+
+//Whether getGlyphFrequencies builds fileInfo's table from a sample rather than from every byte
+bool samplesInput(const FileInfo &fileInfo) {
+    return fileInfo.sampleStride > 1 && fileInfo.fileStreamLength >= MIN_SAMPLED_INPUT;
+}
+
+//Number of glyphs that show up at least once in a vector of glyph counts
+int countGlyphs(const vector<uint64_t> &glyphCounts) {
+    return (int) (glyphCounts.size() - std::count(glyphCounts.begin(), glyphCounts.end(), 0));
+}
+
+//Whether every byte of fileInfo's file is glyph. Reads until the first one that isn't.
+bool isRunFile(FileInfo &fileInfo, char glyph) {
+    auto other = [glyph](char byte) {
+        return byte != glyph;
+    };
+    uint64_t length = fileInfo.fileStreamLength;
+    if (fileInfo.memory != nullptr) {
+        return std::find_if(fileInfo.memory, fileInfo.memory + length, other) == fileInfo.memory + length;
+    }
+    vector<char> chunk(INPUT_CHUNK_SIZE);
+    fileInfo.fileStream.clear();
+    fileInfo.fileStream.seekg(0, ios::beg);
+    for (uint64_t remaining = length; remaining > 0;) {
+        size_t count = (size_t) std::min<uint64_t>(remaining, chunk.size());
+        if (!fileInfo.fileStream.read(chunk.data(), count) ||
+            std::find_if(chunk.data(), chunk.data() + count, other) != chunk.data() + count) {
+            return false;
+        }
+        remaining -= count;
+    }
+    return true;
+}
+
+//Reads through the file and stores how often each glyph appears in glyphCounts, indexed by glyph, with the
+//eof glyph (256) counted once.
+//When sampling (see samplesInput) only one SAMPLE_PIECE_SIZE piece out of every sampleStride is read and counted.
+//Every byte value then gets one more count than it was seen, so bytes the sample missed still get a code. A
+//sample of one byte value alone is checked against the whole file instead (see isRunFile), since a file of
+//nothing else needs exact counts to be written without a table.
+void getGlyphFrequencies(FileInfo &fileInfo, vector<uint64_t> &glyphCounts) {
+    glyphCounts.assign(257, 0);
+    fileInfo.stats.sampledBytes = 0;
+    if (samplesInput(fileInfo)) {
+        vector<char> piece(SAMPLE_PIECE_SIZE);
+        uint64_t length = fileInfo.fileStreamLength;
+        uint64_t step = (uint64_t) SAMPLE_PIECE_SIZE * fileInfo.sampleStride;
+        for (uint64_t position = 0; position < length; position += step) {
+            size_t count = (size_t) std::min<uint64_t>(piece.size(), length - position);
+            if (fileInfo.memory != nullptr) {
+                countBytes(fileInfo.memory + position, count, glyphCounts);
+            } else {
+                fileInfo.fileStream.seekg((std::streamoff) position, ios::beg);
+                fileInfo.fileStream.read(piece.data(), count);
+                countBytes(piece.data(), count, glyphCounts);
+            }
+            fileInfo.stats.sampledBytes += count;
+        }
+        int sampledGlyph = (int) (std::find_if(glyphCounts.begin(), glyphCounts.end(), [](uint64_t count) {
+                                      return count > 0;
+                                  }) - glyphCounts.begin());
+        if (countGlyphs(glyphCounts) == 1 && isRunFile(fileInfo, (char) sampledGlyph)) {
+            glyphCounts[sampledGlyph] = length;
+            fileInfo.stats.sampledBytes = length;
+        } else {
+            for (int glyph = 0; glyph < 256; glyph++) {
+                glyphCounts[glyph]++;
+            }
+        }
+    } else if (fileInfo.memory != nullptr) {
+        countBytes(fileInfo.memory, (size_t) fileInfo.fileStreamLength, glyphCounts);
+        fileInfo.stats.sampledBytes = fileInfo.fileStreamLength;
+    } else {
+        vector<char> chunk(INPUT_CHUNK_SIZE);
+        uint64_t remaining = fileInfo.fileStreamLength;
+        while (remaining > 0) {
+            size_t count = (size_t) std::min<uint64_t>(remaining, chunk.size());
+            fileInfo.fileStream.read(chunk.data(), count);
+            countBytes(chunk.data(), count, glyphCounts);
+            remaining -= count;
+        }
+        fileInfo.stats.sampledBytes = fileInfo.fileStreamLength;
+    }
+
+    // Adding the eof character
+    glyphCounts[256] = 1;
+
+	//return to beginning of file for later
+	fileInfo.fileStream.seekg(0, ios::beg);
+}
+
+
+//Creates a vector of HuffTableEntry to support creating a huffman table later on. Table must be
+//the number of glpyhs plus number of glyphs minus one to support
+//the huffman algorithm. Vector of correct size is created then we iterate through the counts
+//of every glyph (0 to 256) and add the ones that appear to the slots in the array. It then sorts the array from
+//smallest to largest to allow the huffman algorithm to work in a later step.
+void createSortedVectorFromCounts(const vector<uint64_t> &glyphCounts, vector<HuffTableEntry> &huffTableVector) {
+    int numberOfGlyphs = countGlyphs(glyphCounts);
+
+    // Makes the vector as big as we need so that it can be sorted by value, keeping whatever memory it had
+    huffTableVector.assign(numberOfGlyphs + (numberOfGlyphs - 1), HuffTableEntry());
+
+    // Put counts into vector
+    int arrayLocation = 0;
+    for (int glyph = 0; glyph < (int) glyphCounts.size(); glyph++) {
+        if (glyphCounts[glyph] > 0) {
+            huffTableVector[arrayLocation].glyph = glyph;
+            huffTableVector[arrayLocation].frequency = glyphCounts[glyph];
+            arrayLocation++;
+        }
+    }
+
+    sort(huffTableVector.begin(), huffTableVector.begin() + numberOfGlyphs, sortByFrequency);
+}
+
+//Fills in the huffman table by following steps learned in class. We first mark the end of the heap
+//and the first free slot. Then we mark which of slots 1 and 2 in the vector have the lowest value. We 
+//move the marked lowest value to the first free slot, then move the end of the heap to the empty slot just
+//create by moving the lowest value. We then sift it down to ensure that we maintain a min heap. Then we move the 
+//value in slot 0 to the end of the heap, and in slot 0 we create a merge node containing the value just moved
+//from the front of the heap as the left pointer and the value in the first free slot as the right pointer. We
+//sift slot 0 down and then move the end of the heap to the left as to not include the node that was just moved
+//and the first free slot to the right to the next free slot.
+//The table is built into huffTable. It takes two leaves to give every glyph a code, so glyphCounts needs at
+//least two glyphs.
+void buildHuffmanTable(const vector<uint64_t> &glyphCounts, vector<HuffTableEntry> &huffTable) {
+    createSortedVectorFromCounts(glyphCounts, huffTable);
+    int numberOfGlyphs = countGlyphs(glyphCounts);
+
+    // Creating the full huffman table
+    int heapEnd = numberOfGlyphs - 1;
+    int firstFreeSlot = numberOfGlyphs;
+    int marked;
+
+    // Stops 2 early because the last merge doesn't need to be this intense
+    for (int i = 0; i < (numberOfGlyphs - 2); i++) {
+        marked = (huffTable[1].frequency < huffTable[2].frequency) ? 1 : 2;
+        huffTable[firstFreeSlot] = huffTable[marked];
+        huffTable[marked] = huffTable[heapEnd];
+
+        // Only the marked slot and slot 0 ever change, so sifting those two down keeps the heap without
+        // rebuilding it every time
+        minHeap(huffTable, marked, heapEnd - 1);
+
+        huffTable[heapEnd] = huffTable[0];
+        huffTable[0].glyph = -1;
+        huffTable[0].frequency = huffTable[heapEnd].frequency + huffTable[firstFreeSlot].frequency;
+        huffTable[0].leftPointer = heapEnd;
+        huffTable[0].rightPointer = firstFreeSlot;
+
+        minHeap(huffTable, 0, heapEnd - 1);
+
+        heapEnd--;
+        firstFreeSlot++;
+    }
+
+    // Last merge
+    huffTable[firstFreeSlot] = huffTable[0];
+    huffTable[0].glyph = -1;
+    huffTable[0].frequency = huffTable[1].frequency + huffTable[firstFreeSlot].frequency;
+    huffTable[0].leftPointer = 1;
+    huffTable[0].rightPointer = firstFreeSlot;
+}
+
+//Length of the code of every glyph (0 to 256) in a huffman table, found by walking down from the root.
+//Glyphs that aren't in the table get 0.
+vector<int> huffmanCodeLengths(const vector<HuffTableEntry> &huffTable) {
+    vector<int> codeLengths(257);
+    vector<std::pair<int, int>> toVisit(1, std::make_pair(0, 0));
+    while (!toVisit.empty()) {
+        std::pair<int, int> visit = toVisit.back();
+        toVisit.pop_back();
+        const HuffTableEntry &entry = huffTable[visit.first];
+        if (entry.leftPointer == -1 && entry.rightPointer == -1) {
+            codeLengths[entry.glyph] = visit.second;
+            continue;
+        }
+        toVisit.push_back(std::make_pair(entry.leftPointer, visit.second + 1));
+        toVisit.push_back(std::make_pair(entry.rightPointer, visit.second + 1));
+    }
+    return codeLengths;
+}
+
+//Length of the longest code in a huffman table. A table never has more than MAX_TABLE_ENTRIES entries, so the
+//walk down from the root fits in an array on the stack.
+int huffmanTableDepth(const vector<HuffTableEntry> &huffTable) {
+    std::pair<int, int> toVisit[MAX_TABLE_ENTRIES];
+    int visits = 0;
+    int depth = 0;
+    toVisit[visits++] = std::make_pair(0, 0);
+    while (visits > 0) {
+        std::pair<int, int> visit = toVisit[--visits];
+        const HuffTableEntry &entry = huffTable[visit.first];
+        if (entry.leftPointer == -1 && entry.rightPointer == -1) {
+            depth = std::max(depth, visit.second);
+            continue;
+        }
+        toVisit[visits++] = std::make_pair(entry.leftPointer, visit.second + 1);
+        toVisit[visits++] = std::make_pair(entry.rightPointer, visit.second + 1);
+    }
+    return depth;
+}
+
+//Builds a huffman table whose codes are no longer than maxCodeLength bits (0 means no limit) into huffTable.
+//While the tree is too deep, every frequency is halved (rounding up, so nothing drops out) and the tree is built
+//again; that flattens the distribution a little each time until it fits. The halved counts go in counts, which
+//like huffTable keeps its memory from one build to the next.
+void buildLengthLimitedHuffmanTable(const vector<uint64_t> &glyphCounts, int maxCodeLength, vector<uint64_t> &counts,
+                                    vector<HuffTableEntry> &huffTable) {
+    counts.assign(glyphCounts.begin(), glyphCounts.end());
+    // A lone glyph (the eof of an empty file) is paired with one that never turns up
+    for (size_t glyph = 0; countGlyphs(counts) < 2; glyph++) {
+        counts[glyph] = std::max<uint64_t>(counts[glyph], 1);
+    }
+    buildHuffmanTable(counts, huffTable);
+    while (maxCodeLength > 0 && huffmanTableDepth(huffTable) > maxCodeLength) {
+        for (uint64_t &count : counts) {
+            count = (count + 1) / 2;
+        }
+        buildHuffmanTable(counts, huffTable);
+    }
+}
+
+//The same, into a table of its own
+vector<HuffTableEntry> buildLengthLimitedHuffmanTable(const vector<uint64_t> &glyphCounts, int maxCodeLength) {
+    vector<uint64_t> counts;
+    vector<HuffTableEntry> huffTable;
+    buildLengthLimitedHuffmanTable(glyphCounts, maxCodeLength, counts, huffTable);
+    return huffTable;
+}
+
+//Size of the L2 cache of the cores this runs on, or 0 when the system won't say
+size_t l2CacheSize() {
+#if defined(_WIN32)
+    DWORD length = 0;
+    GetLogicalProcessorInformation(nullptr, &length);
+    vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (info.empty() || !GetLogicalProcessorInformation(info.data(), &length)) {
+        return 0;
+    }
+    for (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION &entry : info) {
+        if (entry.Relationship == RelationCache && entry.Cache.Level == 2) {
+            return entry.Cache.Size;
+        }
+    }
+    return 0;
+#elif defined(_SC_LEVEL2_CACHE_SIZE)
+    long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return size > 0 ? (size_t) size : 0;
+#else
+    return 0;
+#endif
+}
+
+//Halves blockSize, down to BLOCK_SIZE at the least, until a block and its encoded copy fit in L2 together, so
+//an encoder worker counts and encodes a block without going back out to memory for it
+size_t cacheFittingBlockSize(size_t blockSize) {
+    static const size_t l2 = l2CacheSize();
+    while (l2 > 0 && blockSize > BLOCK_SIZE && blockSize > l2 / 2) {
+        blockSize /= 2;
+    }
+    return blockSize;
+}
+
+//Copies the settings of a compression level (1 to 9) into fileInfo
+void applyCompressionLevel(FileInfo &fileInfo, int level) {
+    const CompressionLevel &settings = COMPRESSION_LEVELS[level - 1];
+    // Without block tables the block size only decides how far apart the seek points are, so it's free to
+    // shrink to what the cache holds
+    fileInfo.blockSize = settings.blockTables ? settings.blockSize : cacheFittingBlockSize(settings.blockSize);
+    fileInfo.streams = settings.streams;
+    fileInfo.blockTables = settings.blockTables;
+    fileInfo.maxCodeLength = settings.maxCodeLength;
+    fileInfo.checksum = settings.checksum;
+    fileInfo.splitWindow = settings.splitWindow;
+    fileInfo.sampleStride = settings.sampleStride;
+}
+
+//The cores this process is allowed to run on
+vector<int> allowedCores() {
+    vector<int> cores;
+#if defined(_WIN32)
+    DWORD_PTR processMask, systemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        for (int core = 0; core < (int) (8 * sizeof processMask); core++) {
+            if (processMask & ((DWORD_PTR) 1 << core)) {
+                cores.push_back(core);
+            }
+        }
+    }
+#elif defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == 0) {
+        for (int core = 0; core < CPU_SETSIZE; core++) {
+            if (CPU_ISSET(core, &allowed)) {
+                cores.push_back(core);
+            }
+        }
+    }
+#endif
+    return cores;
+}
+
+//How many cores this process may use. That can be fewer than the machine has (hardware_concurrency), when
+//it's been given only some of them, as with taskset or a container's cpuset.
+int availableCores() {
+    vector<int> cores = allowedCores();
+    return cores.empty() ? std::max(1, (int) std::thread::hardware_concurrency()) : (int) cores.size();
+}
+
+//Encoder threads to use when fileInfo.workers leaves it to the machine: one per core, less one for the writer
+int encoderWorkers(const FileInfo &fileInfo) {
+    return fileInfo.workers > 0 ? fileInfo.workers : std::max(1, availableCores() - 1);
+}
+
+//Most memory encodeBlocks might hold at once: every block in flight at up to twice its size while it's encoded,
+//a block read in by every worker, and the writer's two buffers
+uint64_t encoderMemory(size_t blockSize, int workers, int blocksInFlight) {
+    return (uint64_t) blocksInFlight * 2 * blockSize + (uint64_t) workers * blockSize + 2 * OUTPUT_BUFFER_SIZE;
+}
+
+//Cuts down what the encoder holds at once until encoderMemory fits in fileInfo.maxMemory: first the blocks in
+//flight to one more than the workers, then the workers one at a time, then the block size, halving it down to
+//MIN_MEMORY_BLOCK_SIZE. Throws when even that doesn't fit.
+void fitToMemory(FileInfo &fileInfo) {
+    int workers = encoderWorkers(fileInfo);
+    int blocksInFlight = fileInfo.blocksInFlight > 0 ? fileInfo.blocksInFlight : 2 * workers + 2;
+    size_t blockSize = fileInfo.blockSize;
+    while (encoderMemory(blockSize, workers, blocksInFlight) > fileInfo.maxMemory) {
+        if (blocksInFlight > workers + 1) {
+            blocksInFlight = workers + 1;
+        } else if (workers > 1) {
+            workers--;
+            blocksInFlight = workers + 1;
+        } else if (blockSize / 2 >= MIN_MEMORY_BLOCK_SIZE) {
+            blockSize /= 2;
+        } else {
+            throw std::runtime_error("can't compress in " + std::to_string((BASE_MEMORY + fileInfo.maxMemory) >> 20) +
+                                     " MB, it takes at least " +
+                                     std::to_string((BASE_MEMORY + encoderMemory(blockSize, 1, 2) + (1 << 20) - 1) >> 20) + " MB");
+        }
+    }
+    fileInfo.workers = workers;
+    fileInfo.blocksInFlight = blocksInFlight;
+    fileInfo.blockSize = blockSize;
+}
+
+//Most memory this process has held at once so far, in bytes, or 0 when the system won't say
+uint64_t peakResidentMemory() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof counters) ? counters.PeakWorkingSetSize : 0;
+#elif defined(__linux__)
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? (uint64_t) usage.ru_maxrss * 1024 : 0;
+#else
+    return 0;
+#endif
+}
+
+//Acts as an entry point to generate the byte codes. Implemented in order to keep other functions more organized
+map<int, string> generateByteCodeTable(vector<HuffTableEntry> &huffTable) {
+    map<int, string> byteCodes;
+    string byteCode;
+
+    generateByteCodes(huffTable, byteCodes, 0, byteCode);
+
+    return byteCodes;
+}
+
+//Tables for the slicing-by-8 CRC32C (Castagnoli polynomial, reflected) used when the CPU has no crc32
+//instruction. entries[0] is the ordinary byte at a time table, entries[k] advances a byte through k more zero bytes.
+struct Crc32cTable {
+    uint32_t entries[8][256];
+
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+            }
+            entries[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                entries[k][i] = entries[0][entries[k - 1][i] & 0xFF] ^ (entries[k - 1][i] >> 8);
+            }
+        }
+    }
+};
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t length) {
+    static const Crc32cTable table;
+    for (; length >= 8; length -= 8, data += 8) {
+        uint32_t low = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24));
+        crc = table.entries[7][low & 0xFF] ^ table.entries[6][(low >> 8) & 0xFF] ^
+              table.entries[5][(low >> 16) & 0xFF] ^ table.entries[4][low >> 24] ^
+              table.entries[3][data[4]] ^ table.entries[2][data[5]] ^
+              table.entries[1][data[6]] ^ table.entries[0][data[7]];
+    }
+    for (; length > 0; length--, data++) {
+        crc = table.entries[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HUFF_HAVE_CRC32_INSTRUCTION
+//Same CRC using the SSE4.2 crc32 instruction, eight bytes per step
+HUFF_TARGET_SSE42 uint32_t crc32cHardware(uint32_t crc, const unsigned char *data, size_t length) {
+    uint64_t crc64 = crc;
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, data, sizeof chunk);
+        crc64 = _mm_crc32_u64(crc64, chunk);
+    }
+    crc = (uint32_t) crc64;
+    for (; length > 0; length--, data++) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+bool cpuHasCrc32Instruction() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2) != 0;
+#endif
+}
+#endif
+
+//Adds a block of memory to a running CRC32C. Start from CRC32C_INITIAL and invert the result when done;
+//crc32c() does both for a single block. Uses the crc32 instruction when this CPU has it.
+uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t length) {
+#ifdef HUFF_HAVE_CRC32_INSTRUCTION
+    static const bool useHardware = cpuHasCrc32Instruction();
+    if (useHardware) {
+        return crc32cHardware(crc, (const unsigned char *) data, length);
+    }
+#endif
+    return crc32cSoftware(crc, (const unsigned char *) data, length);
+}
+
+uint32_t crc32c(const void *data, size_t length) {
+    return ~crc32cUpdate(CRC32C_INITIAL, data, length);
+}
+
+//Multiplies two polynomials modulo the CRC32C polynomial, both reflected like the CRC itself: bit 31 is x^0
+uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = (uint32_t) 1 << 31; bit != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ 0x82F63B78 : b >> 1;
+    }
+    return product;
+}
+
+//x^(2^k) modulo the CRC32C polynomial, reflected, for every k that a 64-bit count of bytes (8 bits each) needs
+struct Crc32cPowers {
+    uint32_t entries[64 + 3];
+
+    Crc32cPowers() {
+        entries[0] = (uint32_t) 1 << 30;
+        for (int k = 1; k < 64 + 3; k++) {
+            entries[k] = crc32cMultiply(entries[k - 1], entries[k - 1]);
+        }
+    }
+};
+
+//The CRC32C of two pieces of data one after the other, from crc32c() of each and the length of the second,
+//without reading either again. Appending the second piece multiplies the CRC of the first by x^(8 * length).
+uint32_t crc32cCombine(uint32_t first, uint32_t second, uint64_t secondLength) {
+    static const Crc32cPowers powers;
+    uint32_t shift = (uint32_t) 1 << 31;
+    for (int k = 3; secondLength != 0; secondLength >>= 1, k++) {
+        if (secondLength & 1) {
+            shift = crc32cMultiply(powers.entries[k], shift);
+        }
+    }
+    return crc32cMultiply(shift, first) ^ second;
+}
+
+// A byte code packed for the bit writer, first code bit in bit 0. Codes longer than MAX_PACKED_CODE_LENGTH
+// only come out of pathological frequency distributions. Their bits go at the end of the code table, 64 to an
+// entry after the 257 glyphs' codes, and bits holds where they start.
+struct PackedCode {
+    uint64_t bits = 0;
+    int length = 0;
+};
+
+//Fills codes with the code of every glyph in huffTable, indexed by glyph, so the encoder can use them directly.
+//The tree is walked down from the root, a left branch adding a 0 to the code and a right one a 1. Glyphs
+//without a leaf get no code. codes keeps its memory from one table to the next.
+void assignCodes(const vector<HuffTableEntry> &huffTable, vector<PackedCode> &codes) {
+    codes.assign(257, PackedCode());
+
+    // Every entry still to visit, with the length of the path down to it and the branch that ends the path. The
+    // bits of the path down to the entry being visited are kept in path; entries are visited depth first, so
+    // the part of it above an entry is still the entry's own path when it comes off the stack.
+    struct Visit {
+        int position;
+        int depth;
+        bool right;
+    };
+    Visit toVisit[MAX_TABLE_ENTRIES];
+    uint64_t path[(MAX_TABLE_ENTRIES + 63) / 64] = {};
+    int visits = 0;
+    toVisit[visits++] = {0, 0, false};
+    while (visits > 0) {
+        Visit visit = toVisit[--visits];
+        if (visit.depth > 0) {
+            uint64_t bit = (uint64_t) 1 << ((visit.depth - 1) % 64);
+            path[(visit.depth - 1) / 64] = visit.right ? path[(visit.depth - 1) / 64] | bit
+                                                       : path[(visit.depth - 1) / 64] & ~bit;
+        }
+        const HuffTableEntry &entry = huffTable[visit.position];
+        if (entry.leftPointer != -1 || entry.rightPointer != -1) {
+            if (entry.rightPointer != -1) {
+                toVisit[visits++] = {entry.rightPointer, visit.depth + 1, true};
+            }
+            if (entry.leftPointer != -1) {
+                toVisit[visits++] = {entry.leftPointer, visit.depth + 1, false};
+            }
+            continue;
+        }
+
+        PackedCode &code = codes[entry.glyph];
+        code.length = visit.depth;
+        if (code.length <= MAX_PACKED_CODE_LENGTH) {
+            code.bits = code.length > 0 ? path[0] & (~(uint64_t) 0 >> (64 - code.length)) : 0;
+            continue;
+        }
+        code.bits = codes.size();
+        for (int word = 0; word * 64 < visit.depth; word++) {
+            int wordLength = std::min(64, visit.depth - word * 64);
+            PackedCode longBits;
+            longBits.bits = path[word] & (~(uint64_t) 0 >> (64 - wordLength));
+            codes.push_back(longBits);
+        }
+    }
+}
+
+// Least recently used cache of shared values, holding up to capacity of them
+template <class Key, class Value>
+class LruCache {
+public:
+    explicit LruCache(size_t capacity) : capacity(capacity) {}
+
+    std::shared_ptr<const Value> find(const Key &key) {
+        auto found = index.find(key);
+        if (found == index.end()) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, found->second);
+        return found->second->second;
+    }
+
+    //Adds value under key, in place of any value key had. Returns the value it replaced or pushed out, if any.
+    std::shared_ptr<const Value> add(const Key &key, std::shared_ptr<const Value> value) {
+        std::shared_ptr<const Value> removed;
+        auto found = index.find(key);
+        if (found != index.end()) {
+            removed = std::move(found->second->second);
+            entries.erase(found->second);
+            index.erase(found);
+        } else if (!entries.empty() && entries.size() >= capacity) {
+            // The least recently used value makes room, and its place in the list is used over for the new one
+            index.erase(entries.back().first);
+            entries.splice(entries.begin(), entries, std::prev(entries.end()));
+            removed = std::move(entries.front().second);
+            entries.front() = std::make_pair(key, std::move(value));
+            index[key] = entries.begin();
+            return removed;
+        }
+        entries.push_front(std::make_pair(key, std::move(value)));
+        index[key] = entries.begin();
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            removed = std::move(entries.back().second);
+            entries.pop_back();
+        }
+        return removed;
+    }
+
+private:
+    typedef std::list<std::pair<Key, std::shared_ptr<const Value>>> EntryList;
+
+    size_t capacity;
+    EntryList entries;
+    std::unordered_map<Key, typename EntryList::iterator> index;
+};
+
+// A huffman table together with the codes the encoder needs from it
+struct CachedTable {
+    vector<HuffTableEntry> huffTable;
+    vector<PackedCode> codes;
+    double penalty = 0;     // how far its codes were from the entropy of the counts it was built for
+};
+
+// Working memory for building tables, kept by whoever builds them over and over so that a build reuses the
+// last one's memory: the counts the code length limit halves, and the glyph counts, table and codes of a block
+// whose size is being estimated or whose own table is being looked up
+struct TableScratch {
+    vector<uint64_t> counts;
+    vector<uint64_t> glyphCounts;
+    vector<HuffTableEntry> huffTable;
+    vector<PackedCode> codes;
+};
+
+// What a TableCache looks tables up by: the signature of a set of glyph counts, and the bits the counts would
+// take at their entropy, which codePenalty measures codes against
+struct HistogramShape {
+    uint64_t signature = 0;
+    double entropyBits = 0;
+};
+
+//The shape of a set of glyph counts. The signature is every glyph that shows up with its rounded ideal code
+//length, and the code length limit, hashed together, so counts that would give about the same codes get the
+//same signature. Both come out of one log2 for every glyph that shows up.
+HistogramShape histogramShape(const vector<uint64_t> &glyphCounts, int maxCodeLength) {
+    double total = 0;
+    for (uint64_t count : glyphCounts) {
+        total += count;
+    }
+    HistogramShape shape;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t glyph = 0; glyph < glyphCounts.size(); glyph++) {
+        if (glyphCounts[glyph] == 0) {
+            continue;
+        }
+        double bits = std::log2(total / glyphCounts[glyph]);
+        shape.entropyBits += glyphCounts[glyph] * bits;
+        int idealLength = 1 + (int) bits;
+        hash = (hash ^ (glyph << 8 | (uint64_t) idealLength)) * 1099511628211ULL;
+    }
+    shape.signature = (hash ^ (uint64_t) maxCodeLength) * 1099511628211ULL;
+    return shape;
+}
+
+//How many more bits the codes take for glyphs with these counts than entropyBits, the counts' entropy (see
+//histogramShape), 0.01 meaning 1%. Infinite when a glyph that shows up has no code.
+double codePenalty(const vector<uint64_t> &glyphCounts, const vector<PackedCode> &codes, double entropyBits) {
+    uint64_t codeBits = 0;
+    bool missing = false;
+    for (size_t glyph = 0; glyph < glyphCounts.size(); glyph++) {
+        missing |= glyphCounts[glyph] != 0 && codes[glyph].length == 0;
+        codeBits += glyphCounts[glyph] * codes[glyph].length;
+    }
+    if (missing) {
+        return HUGE_VAL;
+    }
+    return entropyBits > 0 ? codeBits / entropyBits - 1 : 0;
+}
+
+//Builds a table for glyphs with these counts (257 of them, the eof glyph included) and its codes over whatever
+//table held before, in scratch
+void buildCachedTable(const vector<uint64_t> &glyphCounts, int maxCodeLength, TableScratch &scratch,
+                      CachedTable &table) {
+    buildLengthLimitedHuffmanTable(glyphCounts, maxCodeLength, scratch.counts, table.huffTable);
+    assignCodes(table.huffTable, table.codes);
+    table.penalty = codePenalty(glyphCounts, table.codes, histogramShape(glyphCounts, maxCodeLength).entropyBits);
+}
+
+//The same, into a table of its own
+std::shared_ptr<CachedTable> buildCachedTable(const vector<uint64_t> &glyphCounts, int maxCodeLength,
+                                              TableScratch &scratch) {
+    std::shared_ptr<CachedTable> table = std::make_shared<CachedTable>();
+    buildCachedTable(glyphCounts, maxCodeLength, scratch, *table);
+    return table;
+}
+
+//The same, for a table built just once
+std::shared_ptr<CachedTable> buildCachedTable(const vector<uint64_t> &glyphCounts, int maxCodeLength) {
+    TableScratch scratch;
+    return buildCachedTable(glyphCounts, maxCodeLength, scratch);
+}
+
+// A decoder kept by a TableCache, with the table it was built from to tell it apart from another table's
+// decoder under the same hash
+struct CachedDecoder {
+    vector<HuffTableEntry> huffTable;
+    Decoder decoder;
+};
+
+// Huffman tables kept around for reuse across blocks and across files compressed by the same process. The
+// encoder looks tables up by histogramShape and takes a cached one when its codes do at most
+// TABLE_CACHE_MAX_PENALTY worse on the new counts than they did on their own. The decoder looks up the Decoder
+// for a table by the table itself. A table or decoder that drops out of the cache while nothing else holds it
+// is kept to build the next one over. Safe to share between threads.
+class TableCache {
+public:
+    explicit TableCache(size_t capacity) : tables(capacity), decoders(capacity) {}
+
+    //A table for glyphs with these counts, from the cache when there is one good enough. A table that has to be
+    //built is built in scratch, when there is one.
+    std::shared_ptr<const CachedTable> table(const vector<uint64_t> &glyphCounts, int maxCodeLength,
+                                             TableScratch *scratch = nullptr) {
+        HistogramShape shape = histogramShape(glyphCounts, maxCodeLength);
+        std::shared_ptr<const CachedTable> cached;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cached = tables.find(shape.signature);
+        }
+        if (cached && codePenalty(glyphCounts, cached->codes, shape.entropyBits) <=
+                          cached->penalty + TABLE_CACHE_MAX_PENALTY) {
+            return cached;
+        }
+
+        std::shared_ptr<CachedTable> built;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            built = std::move(spareTable);
+        }
+        if (!built) {
+            built = std::make_shared<CachedTable>();
+        }
+        TableScratch ownScratch;
+        buildCachedTable(glyphCounts, maxCodeLength, scratch != nullptr ? *scratch : ownScratch, *built);
+        std::lock_guard<std::mutex> lock(mutex);
+        keepSpare(tables.add(shape.signature, built), spareTable);
+        return built;
+    }
+
+    //The decoder for a table, from the cache when the same table has been decoded before
+    std::shared_ptr<const Decoder> decoder(const vector<HuffTableEntry> &huffTable);
+
+private:
+    //Keeps a value that has come out of the cache as spare, when nothing else holds it. Only the cache hands its
+    //values out, so nothing will later either.
+    template <class Value>
+    static void keepSpare(std::shared_ptr<const Value> removed, std::shared_ptr<Value> &spare) {
+        if (removed.use_count() == 1) {
+            spare = std::const_pointer_cast<Value>(removed);
+        }
+    }
+
+    std::mutex mutex;
+    LruCache<uint64_t, CachedTable> tables;
+    LruCache<uint64_t, CachedDecoder> decoders;
+    std::shared_ptr<CachedTable> spareTable;
+    std::shared_ptr<CachedDecoder> spareDecoder;
+};
+
+//The cache shared by everything in this process
+TableCache &sharedTableCache() {
+    static TableCache cache(TABLE_CACHE_CAPACITY);
+    return cache;
+}
+
+//The table for a file that's empty, or one byte over and over, given its glyph counts. Such a file goes out as
+//run blocks that never use the table, so a lone leaf for its first glyph is enough to fill the header.
+std::shared_ptr<const CachedTable> loneLeafTable(const vector<uint64_t> &glyphCounts) {
+    std::shared_ptr<CachedTable> table = std::make_shared<CachedTable>();
+    HuffTableEntry leaf;
+    leaf.glyph = 0;
+    while (glyphCounts[leaf.glyph] == 0) {
+        leaf.glyph++;
+    }
+    leaf.frequency = glyphCounts[leaf.glyph];
+    table->huffTable.push_back(leaf);
+    table->codes.resize(257);
+    return table;
+}
+
+//The byte fileInfo's file is made of, over and over, when its counts (exact ones, not a sample) show no other;
+//-1 for any other file, an empty one, or one that hasn't been counted
+int runGlyph(const FileInfo &fileInfo) {
+    const vector<uint64_t> &counts = fileInfo.glyphCounts;
+    if (counts.size() != 257 || fileInfo.fileStreamLength == 0) {
+        return -1;
+    }
+    for (int glyph = 0; glyph < 256; glyph++) {
+        if (counts[glyph] != 0) {
+            return counts[glyph] == fileInfo.fileStreamLength ? glyph : -1;
+        }
+    }
+    return -1;
+}
+
+//Counts the glyphs in the file and builds the table for the whole file from them, along with its codes, or
+//takes one from fileInfo's table cache if it has one. A table that has to be built is built in fileInfo's
+//table scratch, when it has one.
+std::shared_ptr<const CachedTable> createHuffmanTable(FileInfo &fileInfo) {
+    vector<uint64_t> &glyphCounts = fileInfo.glyphCounts;
+    getGlyphFrequencies(fileInfo, glyphCounts);
+    fileInfo.numberOfGlyphsInFile = countGlyphs(glyphCounts);
+
+    if (fileInfo.numberOfGlyphsInFile <= 2) {
+        return loneLeafTable(glyphCounts);
+    }
+    if (fileInfo.tableCache != nullptr) {
+        return fileInfo.tableCache->table(glyphCounts, fileInfo.maxCodeLength, fileInfo.tableScratch);
+    }
+    if (fileInfo.tableScratch != nullptr) {
+        return buildCachedTable(glyphCounts, fileInfo.maxCodeLength, *fileInfo.tableScratch);
+    }
+    return buildCachedTable(glyphCounts, fileInfo.maxCodeLength);
+}
+
+// Collects output in a fixed size buffer and hands each full buffer to a background thread that writes it to
+// the stream, so encoding the next buffer overlaps writing the last one. A bufferSize of 0 sends everything straight to the stream instead, for streams in memory, where there's no
+// write to wait for and a buffer would only be one more copy.
+class BufferedWriter {
+public:
+    explicit BufferedWriter(std::ostream &out, size_t bufferSize = OUTPUT_BUFFER_SIZE)
+        : out(out), bufferSize(bufferSize) {
+        if (bufferSize > 0) {
+            buffers[0].reserve(bufferSize);
+            buffers[1].reserve(bufferSize);
+            writerThread = std::thread(&BufferedWriter::writeBuffers, this);
+        }
+    }
+
+    ~BufferedWriter() {
+        finish();
+    }
+
+    void put(char byte) {
+        if (bufferSize == 0) {
+            write(&byte, 1);
+            return;
+        }
+        buffers[active].push_back(byte);
+        if (buffers[active].size() == bufferSize) {
+            submit();
+        }
+    }
+
+    void write(const char *data, size_t length) {
+        if (bufferSize == 0) {
+            out.write(data, length);
+            return;
+        }
+        while (length > 0) {
+            size_t count = std::min(length, bufferSize - buffers[active].size());
+            buffers[active].insert(buffers[active].end(), data, data + count);
+            data += count;
+            length -= count;
+            if (buffers[active].size() == bufferSize) {
+                submit();
+            }
+        }
+    }
+
+    //Writes out whatever is still buffered and waits for the background thread to finish. Safe to call twice.
+    void finish() {
+        if (!writerThread.joinable()) {
+            return;
+        }
+        submit();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done = true;
+        }
+        changed.notify_all();
+        writerThread.join();
+    }
+
+private:
+    //Waits for the previous buffer to be written, then swaps them
+    void submit() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !pending; });
+        pending = true;
+        pendingIndex = active;
+        active ^= 1;
+        buffers[active].clear();
+        lock.unlock();
+        changed.notify_all();
+    }
+
+    void writeBuffers() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] { return pending || done; });
+            if (!pending) {
+                return;
+            }
+            vector<char> &buffer = buffers[pendingIndex];
+            lock.unlock();
+            out.write(buffer.data(), buffer.size());
+            lock.lock();
+            pending = false;
+            changed.notify_all();
+        }
+    }
+
+    std::ostream &out;
+    size_t bufferSize;
+    vector<char> buffers[2];
+    int active = 0;
+    int pendingIndex = 0;
+    bool pending = false;
+    bool done = false;
+    std::thread writerThread;
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+// Where encoded bytes go: onto the end of a string, which grows as they come, or into a caller's buffer, which
+// doesn't, so compressSpan can encode straight into the buffer it was given. It takes the string calls the
+// encoders make, plus write() so the block writer can put blocks in one as it would in a BufferedWriter. Going
+// past the end of a buffer throws; the encoders check room() first wherever their output could get that big.
+class EncodedBytes {
+public:
+    explicit EncodedBytes(string &grown) : grown(&grown) {}
+    EncodedBytes(char *start, size_t capacity) : start(start), capacity(capacity) {}
+
+    size_t size() const {
+        return grown != nullptr ? grown->size() : length;
+    }
+
+    char *data() {
+        return grown != nullptr ? &(*grown)[0] : start;
+    }
+
+    char &operator[](size_t position) {
+        return data()[position];
+    }
+
+    //How many more bytes there's space for
+    size_t room() const {
+        return grown != nullptr ? grown->max_size() - grown->size() : capacity - length;
+    }
+
+    void resize(size_t size) {
+        if (grown != nullptr) {
+            grown->resize(size);
+            return;
+        }
+        if (size > capacity) {
+            throw std::runtime_error("the output buffer is too small, compressBound says how big it needs to be");
+        }
+        length = size;
+    }
+
+    void reserve(size_t size) {
+        if (grown != nullptr) {
+            grown->reserve(size);
+        }
+    }
+
+    void clear() {
+        resize(0);
+    }
+
+    void push_back(char byte) {
+        if (grown != nullptr) {
+            grown->push_back(byte);
+            return;
+        }
+        resize(length + 1);
+        start[length - 1] = byte;
+    }
+
+    void append(const char *bytes, size_t count) {
+        size_t end = size();
+        resize(end + count);
+        memcpy(data() + end, bytes, count);
+    }
+
+    void write(const char *bytes, size_t count) {
+        append(bytes, count);
+    }
+
+private:
+    string *grown = nullptr;
+    char *start = nullptr;
+    size_t capacity = 0;
+    size_t length = 0;
+};
+
+// Packs codes into bytes, least significant bit first (the bit order of every .huf version), and appends
+// every finished byte to the output. Fewer than 8 bits are ever left waiting.
+struct BitWriter {
+    EncodedBytes &out;
+    uint64_t accumulator = 0;
+    int count = 0;
+
+    explicit BitWriter(EncodedBytes &out) : out(out) {}
+
+    void writeBits(uint64_t bits, int length) {
+        accumulator |= bits << count;
+        count += length;
+        while (count >= 8) {
+            out.push_back((char) accumulator);
+            accumulator >>= 8;
+            count -= 8;
+        }
+    }
+
+    //Writes the code of glyph from a table of codes (see PackedCode), which may be one at the end of the table
+    void writeCode(const vector<PackedCode> &codes, int glyph) {
+        const PackedCode &code = codes[glyph];
+        if (code.length <= MAX_PACKED_CODE_LENGTH) {
+            writeBits(code.bits, code.length);
+            return;
+        }
+        for (int written = 0; written < code.length; written += 32) {
+            uint64_t word = codes[code.bits + written / 64].bits >> (written % 64);
+            int length = std::min(32, code.length - written);
+            writeBits(word & (((uint64_t) 1 << length) - 1), length);
+        }
+    }
+
+    //Pads the last byte with 0's
+    void flush() {
+        if (count > 0) {
+            out.push_back((char) accumulator);
+        }
+        accumulator = 0;
+        count = 0;
+    }
+};
+
+// Bounded multi-producer multi-consumer queue connecting the stages of the compression pipeline. Lock free:
+// every cell carries a sequence number that tells producers and consumers whose turn it is, so the only shared
+// writes are one compare-and-swap per push or pop (the design from Dmitry Vyukov's bounded MPMC queue).
+// push() and pop() spin for a little while when the queue is full or empty, since the other side is usually
+// about to get there, then sleep on a condition variable until it does, so a stage that waits on a slow one
+// doesn't keep a core busy doing nothing.
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueuePosition.store(0, std::memory_order_relaxed);
+        dequeuePosition.store(0, std::memory_order_relaxed);
+    }
+
+    bool tryPush(T &value) {
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &value) {
+        size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+            if (difference == 0) {
+                if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->sequence.store(position + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    void push(T value) {
+        if (!spinUntil([&] { return tryPush(value); })) {
+            std::unique_lock<std::mutex> lock(mutex);
+            pushersWaiting++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            notFull.wait(lock, [&] { return tryPush(value); });
+            pushersWaiting--;
+        }
+        wake(poppersWaiting, notEmpty);
+    }
+
+    T pop() {
+        T value;
+        if (!spinUntil([&] { return tryPop(value); })) {
+            std::unique_lock<std::mutex> lock(mutex);
+            poppersWaiting++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            notEmpty.wait(lock, [&] { return tryPop(value); });
+            poppersWaiting--;
+        }
+        wake(pushersWaiting, notFull);
+        return value;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    // How many times push() and pop() try again, yielding in between, before they go to sleep
+    static const int SPINS = 64;
+
+    template <class Attempt>
+    static bool spinUntil(const Attempt &attempt) {
+        for (int spin = 0; spin < SPINS; spin++) {
+            if (attempt()) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    // Wakes a thread sleeping on condition, if there is one. The fence pairs with the one a sleeper passes
+    // between counting itself in waiting and trying once more, so either it sees what was just pushed or
+    // popped, or it is seen here.
+    void wake(std::atomic<int> &waiting, std::condition_variable &condition) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            condition.notify_one();
+        }
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePosition;
+    alignas(64) std::atomic<size_t> dequeuePosition;
+    alignas(64) std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::atomic<int> pushersWaiting{0};
+    std::atomic<int> poppersWaiting{0};
+};
+
+// A piece of the input on its way through the pipeline. The dispatcher hands out its index, an encoder worker
+// reads and encodes it, and the writer puts blocks back in index order.
+struct Block {
+    size_t index = 0;
+    string encoded;
+    uint32_t checksum = 0;
+};
+
+// Marks the end of the blocks for an encoder worker
+const size_t NO_MORE_BLOCKS = SIZE_MAX;
+
+//Stores a little-endian 32-bit value over 4 bytes that have already been reserved in the output
+void storeUint32(EncodedBytes &out, size_t position, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[position + i] = (char) (value >> (8 * i));
+    }
+}
+
+//How many of a block's bytes go in each of its streams. Every stream but the last gets a segment of
+//(length + streams - 1) / streams bytes, or whatever is left; the last one gets the rest. Counts never increase
+//from one stream to the next.
+size_t streamLength(size_t length, int streams, int stream) {
+    size_t segment = (length + streams - 1) / streams;
+    size_t start = std::min(length, segment * stream);
+    return stream == streams - 1 ? length - start : std::min(segment, length - start);
+}
+
+//Number of bytes a huffman table takes up in a block: a 16-bit entry count and 3 16-bit fields per entry
+size_t blockTableSize(const vector<HuffTableEntry> &huffTable) {
+    return 2 + 6 * huffTable.size();
+}
+
+//Turns byte counts into the glyph counts of a block table. The eof glyph is added, as in the file's table,
+//so that every tree has at least two leaves.
+void blockGlyphCounts(const vector<uint64_t> &counts, vector<uint64_t> &glyphCounts) {
+    glyphCounts.assign(counts.begin(), counts.begin() + 256);
+    glyphCounts.push_back(1);
+}
+
+vector<uint64_t> blockGlyphCounts(const vector<uint64_t> &counts) {
+    vector<uint64_t> glyphCounts;
+    blockGlyphCounts(counts, glyphCounts);
+    return glyphCounts;
+}
+
+//Bits needed to encode bytes with these counts using the file's codes
+uint64_t fileCodeBits(const vector<uint64_t> &counts, const vector<PackedCode> &fileCodes) {
+    uint64_t bits = 0;
+    for (int glyph = 0; glyph < 256; glyph++) {
+        bits += (uint64_t) counts[glyph] * fileCodes[glyph].length;
+    }
+    return bits;
+}
+
+//Estimates how many bits a block with these byte counts takes up: its header and jump table, then either its
+//own table and codes or the file's codes, whichever is smaller. The table is built just like the real one, so
+//the estimate only misses the padding at the end of each stream. A run of one byte goes out as a run block.
+//The table is built in scratch.
+uint64_t estimateBlockBits(const vector<uint64_t> &counts, const vector<PackedCode> &fileCodes, int maxCodeLength,
+                           int streams, TableScratch &scratch) {
+    if (countGlyphs(counts) == 1) {
+        return 8 * (BLOCK_HEADER_SIZE + 1);
+    }
+    blockGlyphCounts(counts, scratch.glyphCounts);
+    buildLengthLimitedHuffmanTable(scratch.glyphCounts, maxCodeLength, scratch.counts, scratch.huffTable);
+    assignCodes(scratch.huffTable, scratch.codes);
+    uint64_t ownBits = 8 * (blockTableSize(scratch.huffTable) - 2);
+    for (int glyph = 0; glyph < 256; glyph++) {
+        ownBits += (uint64_t) counts[glyph] * scratch.codes[glyph].length;
+    }
+    uint64_t overhead = 8 * (BLOCK_HEADER_SIZE + 2 + 4 * (streams - 1));
+    return overhead + std::min(ownBits, fileCodeBits(counts, fileCodes));
+}
+
+//Cuts a block into pieces where the data changes enough that separate tables pay for their extra headers.
+//The block is looked at window bytes at a time, left to right: each window either joins the current piece or
+//starts a new one, whichever makes the estimated size (see estimateBlockBits) smaller. The current piece's
+//counts and estimate are carried along, so each window costs two table builds however long the piece gets,
+//both in scratch. Returns the length of every piece.
+vector<size_t> splitBlock(const char *data, size_t blockLength, const vector<PackedCode> &fileCodes,
+                          const FileInfo &fileInfo, TableScratch &scratch) {
+    size_t window = fileInfo.splitWindow;
+    vector<size_t> pieces;
+    if (window == 0 || blockLength <= window) {
+        pieces.push_back(blockLength);
+        return pieces;
+    }
+
+    vector<uint64_t> pieceCounts(256);
+    countBytes(data, window, pieceCounts);
+    size_t pieceLength = window;
+    uint64_t pieceBits = estimateBlockBits(pieceCounts, fileCodes, fileInfo.maxCodeLength, fileInfo.streams, scratch);
+
+    vector<uint64_t> windowCounts;
+    vector<uint64_t> joinedCounts;
+    for (size_t start = window; start < blockLength; start += window) {
+        size_t length = std::min(window, blockLength - start);
+        windowCounts.assign(256, 0);
+        countBytes(data + start, length, windowCounts);
+        joinedCounts = pieceCounts;
+        for (int glyph = 0; glyph < 256; glyph++) {
+            joinedCounts[glyph] += windowCounts[glyph];
+        }
+
+        uint64_t windowBits = estimateBlockBits(windowCounts, fileCodes, fileInfo.maxCodeLength, fileInfo.streams,
+                                                scratch);
+        uint64_t joinedBits = estimateBlockBits(joinedCounts, fileCodes, fileInfo.maxCodeLength, fileInfo.streams,
+                                                scratch);
+        if (pieceBits + windowBits < joinedBits) {
+            pieces.push_back(pieceLength);
+            pieceCounts.swap(windowCounts);
+            pieceLength = length;
+            pieceBits = windowBits;
+        } else {
+            pieceCounts.swap(joinedCounts);
+            pieceLength += length;
+            pieceBits = joinedBits;
+        }
+    }
+    pieces.push_back(pieceLength);
+    return pieces;
+}
+
+//Builds a table for just this block (or takes one from cache, if there is one) and decides whether it pays for
+//itself: the block's bits under its own codes plus the table have to come to less than its bits under the
+//file's codes. Returns the table when they do, null otherwise. Tables are built in scratch.
+std::shared_ptr<const CachedTable> buildBlockTable(const char *data, size_t length, const vector<PackedCode> &fileCodes,
+                                                   int maxCodeLength, TableCache *cache, TableScratch &scratch) {
+    vector<uint64_t> &glyphCounts = scratch.glyphCounts;
+    glyphCounts.assign(257, 0);
+    countBytes(data, length, glyphCounts);
+    glyphCounts[256] = 1;
+    std::shared_ptr<const CachedTable> table = cache != nullptr ? cache->table(glyphCounts, maxCodeLength, &scratch)
+                                                                : buildCachedTable(glyphCounts, maxCodeLength, scratch);
+
+    uint64_t blockCodeBits = 8 * (blockTableSize(table->huffTable) - 2);
+    for (int glyph = 0; glyph < 256; glyph++) {
+        blockCodeBits += (uint64_t) glyphCounts[glyph] * table->codes[glyph].length;
+    }
+    return blockCodeBits < fileCodeBits(glyphCounts, fileCodes) ? table : nullptr;
+}
+
+//Appends a little-endian 16-bit value to the output
+void appendUint16(EncodedBytes &out, uint16_t value) {
+    out.push_back((char) (value & 0xFF));
+    out.push_back((char) (value >> 8));
+}
+
+//Bytes the codes of count bytes at data come to as one bitstream, padded to a whole byte
+size_t encodedStreamSize(const char *data, size_t count, const vector<PackedCode> &codes) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; i++) {
+        bits += codes[(unsigned char) data[i]].length;
+    }
+    return (size_t) ((bits + 7) / 8);
+}
+
+//Appends the codes of count bytes at data to encoded as one bitstream, padded to a whole byte. Specialized at
+//compile time on the longest code it has to handle: with a bound, as many codes as are sure to fit go into the
+//64-bit accumulator between stores, and each store writes all 8 bytes at once into space reserved up front.
+//ANY_CODE_LENGTH goes through the BitWriter, which also takes codes longer than the accumulator, and so does a
+//stream that a caller's buffer has room for but not for the bound's worth of stores. Returns false, having
+//added nothing, when the buffer doesn't have room for the codes at all.
+template <int MaxCodeLength>
+bool encodeStream(const char *data, size_t count, const vector<PackedCode> &codes, EncodedBytes &encoded) {
+    bool byteAtATime = MaxCodeLength == ANY_CODE_LENGTH;
+    // The last store can write up to 7 bytes past the end of the codes
+    size_t reserved = byteAtATime ? SIZE_MAX : (count * MaxCodeLength + 7) / 8 + 8;
+    if (reserved > encoded.room()) {
+        size_t exact = encodedStreamSize(data, count, codes);
+        if (exact > encoded.room()) {
+            return false;
+        }
+        reserved = exact + 8;
+        byteAtATime = byteAtATime || reserved > encoded.room();
+    }
+    if (byteAtATime) {
+        BitWriter bits(encoded);
+        for (size_t i = 0; i < count; i++) {
+            bits.writeCode(codes, (unsigned char) data[i]);
+        }
+        bits.flush();
+        return true;
+    }
+
+    // Up to 7 bits are left over after each store
+    const int codesPerStore = MaxCodeLength < 57 ? 57 / MaxCodeLength : 1;
+    size_t start = encoded.size();
+    encoded.resize(start + reserved);
+    unsigned char *out = (unsigned char *) &encoded[start];
+
+    uint64_t accumulator = 0;
+    int pending = 0;
+    size_t i = 0;
+    for (; i + codesPerStore <= count; i += codesPerStore) {
+        for (int k = 0; k < codesPerStore; k++) {
+            const PackedCode &code = codes[(unsigned char) data[i + k]];
+            accumulator |= code.bits << pending;
+            pending += code.length;
+        }
+        memcpy(out, &accumulator, sizeof accumulator);
+        out += pending >> 3;
+        accumulator = (pending & ~7) == 64 ? 0 : accumulator >> (pending & ~7);
+        pending &= 7;
+    }
+    for (; i < count; i++) {
+        const PackedCode &code = codes[(unsigned char) data[i]];
+        accumulator |= code.bits << pending;
+        pending += code.length;
+        memcpy(out, &accumulator, sizeof accumulator);
+        out += pending >> 3;
+        accumulator >>= pending & ~7;
+        pending &= 7;
+    }
+    if (pending > 0) {
+        *out++ = (unsigned char) accumulator;
+    }
+    encoded.resize(out - (unsigned char *) &encoded[0]);
+    return true;
+}
+
+typedef bool (*EncodeStreamFunction)(const char *data, size_t count, const vector<PackedCode> &codes,
+                                     EncodedBytes &encoded);
+
+// The encodeStream instantiations there are, shortest bound first
+struct EncodeKernelEntry {
+    int maxCodeLength;
+    EncodeStreamFunction encode;
+};
+
+const EncodeKernelEntry ENCODE_KERNELS[] = {
+    {8, encodeStream<8>},
+    {11, encodeStream<11>},
+    {14, encodeStream<14>},
+    {19, encodeStream<19>},
+    {28, encodeStream<28>},
+    {ANY_CODE_LENGTH, encodeStream<ANY_CODE_LENGTH>},
+};
+
+//Picks the encoding loop with the tightest bound that still covers every byte's code
+EncodeStreamFunction findEncodeKernel(const vector<PackedCode> &codes) {
+    int maxCodeLength = 0;
+    for (int glyph = 0; glyph < 256; glyph++) {
+        maxCodeLength = std::max(maxCodeLength, codes[glyph].length);
+    }
+    for (const EncodeKernelEntry &kernel : ENCODE_KERNELS) {
+        if (maxCodeLength <= kernel.maxCodeLength) {
+            return kernel.encode;
+        }
+    }
+    return encodeStream<ANY_CODE_LENGTH>;
+}
+
+//Appends one block (sizes, optional table, stream jump table, then the codes) to encoded, decodable on its own.
+//Returns false when it doesn't fit in what's left of a caller's buffer.
+bool encodeBlock(const char *data, size_t length, const vector<HuffTableEntry> *blockTable,
+                 const vector<PackedCode> &codes, int streams, EncodedBytes &encoded) {
+    size_t jumpTableSize = streams > 1 ? 4 * (streams - 1) : 0;
+    size_t blockStart = encoded.size();
+    if (encoded.room() < BLOCK_HEADER_SIZE + (blockTable != nullptr ? blockTableSize(*blockTable) : 0) + jumpTableSize) {
+        return false;
+    }
+    encoded.reserve(blockStart + BLOCK_HEADER_SIZE + jumpTableSize + length);
+    encoded.resize(blockStart + BLOCK_HEADER_SIZE);
+
+    if (blockTable != nullptr) {
+        appendUint16(encoded, (uint16_t) blockTable->size());
+        for (const HuffTableEntry &entry : *blockTable) {
+            appendUint16(encoded, (uint16_t) entry.glyph);
+            appendUint16(encoded, (uint16_t) entry.leftPointer);
+            appendUint16(encoded, (uint16_t) entry.rightPointer);
+        }
+    }
+    size_t jumpTableStart = encoded.size();
+    encoded.resize(jumpTableStart + jumpTableSize);
+
+    EncodeStreamFunction encodeStream = findEncodeKernel(codes);
+    const char *next = data;
+    for (int stream = 0; stream < streams; stream++) {
+        size_t streamStart = encoded.size();
+        size_t count = streamLength(length, streams, stream);
+        if (!encodeStream(next, count, codes, encoded)) {
+            return false;
+        }
+        next += count;
+
+        if (stream < streams - 1) {
+            storeUint32(encoded, jumpTableStart + 4 * stream, (uint32_t) (encoded.size() - streamStart));
+        }
+    }
+
+    storeUint32(encoded, blockStart, (uint32_t) length);
+    storeUint32(encoded, blockStart + 4, (uint32_t) (encoded.size() - blockStart - BLOCK_HEADER_SIZE));
+    return true;
+}
+
+//Whether the length bytes at data are all the same, so they can go out as a run block. Every byte equal to
+//the one after it is the same thing, and memcmp checks that faster than a loop and stops at the first difference.
+bool isRun(const char *data, size_t length) {
+    return length > 0 && std::memcmp(data, data + 1, length - 1) == 0;
+}
+
+//Appends a block of length copies of glyph (files with HUFF_FLAG_RUN_BLOCKS): the same sizes as any other
+//block, but with RUN_BLOCK_BIT set in the encoded size, and then the byte itself. There's no table or code
+//to go through, so it takes nothing to decode but filling the output.
+void encodeRunBlock(char glyph, size_t length, EncodedBytes &encoded) {
+    size_t blockStart = encoded.size();
+    encoded.resize(blockStart + BLOCK_HEADER_SIZE);
+    storeUint32(encoded, blockStart, (uint32_t) length);
+    storeUint32(encoded, blockStart + 4, RUN_BLOCK_BIT | 1);
+    encoded.push_back(glyph);
+}
+
+//Appends the length bytes at data as they are (files with HUFF_FLAG_RAW_BLOCKS), for data that codes would
+//only make bigger: the usual sizes, with RAW_BLOCK_BIT set in the encoded size, then the bytes. No block comes
+//out more than its header bigger than its input this way, which is what compressBound counts on.
+void encodeRawBlock(const char *data, size_t length, EncodedBytes &encoded) {
+    size_t blockStart = encoded.size();
+    encoded.resize(blockStart + BLOCK_HEADER_SIZE);
+    storeUint32(encoded, blockStart, (uint32_t) length);
+    storeUint32(encoded, blockStart + 4, RAW_BLOCK_BIT | (uint32_t) length);
+    encoded.append(data, length);
+}
+
+//Keeps a thread on one core, so the memory it touches first comes from that core's NUMA node and stays there
+//for it. Does nothing where there's no way to ask for that.
+void pinThread(std::thread &thread, int core) {
+#if defined(_WIN32)
+    SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR) 1 << core);
+#elif defined(__linux__)
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(core, &one);
+    pthread_setaffinity_np(thread.native_handle(), sizeof one, &one);
+#else
+    (void) thread;
+    (void) core;
+#endif
+}
+
+//Encodes one block of the file onto the end of encoded. A block may go out as several smaller ones, each with
+//its own table; the seek index only points at the first. A block that's one byte over and over isn't worth
+//splitting. A piece its codes would make bigger, or that runs out of room in a caller's buffer, goes out raw.
+//With fileInfo.checksum every piece is added to the running CRC32C in crc as soon as it's done, while it's still
+//in cache. Tables of the pieces' own are built in scratch. Returns whether any of it was coded with the file's
+//table.
+bool encodeBlockPieces(const char *data, size_t length, const vector<PackedCode> &codes, const FileInfo &fileInfo,
+                       TableScratch &scratch, EncodedBytes &encoded, uint32_t &crc) {
+    static const vector<HuffTableEntry> noTable;
+    bool usesFileTable = false;
+    const char *piece = data;
+    vector<size_t> pieces = isRun(data, length) ? vector<size_t>(1, length)
+                                                : splitBlock(data, length, codes, fileInfo, scratch);
+    for (size_t pieceLength : pieces) {
+        size_t pieceStart = encoded.size();
+        if (isRun(piece, pieceLength)) {
+            encodeRunBlock(piece[0], pieceLength, encoded);
+        } else {
+            // A piece that's the whole file would only get the file's own table again
+            std::shared_ptr<const CachedTable> ownTable;
+            if (fileInfo.blockTables && pieceLength < fileInfo.fileStreamLength) {
+                ownTable = buildBlockTable(piece, pieceLength, codes, fileInfo.maxCodeLength, fileInfo.tableCache,
+                                           scratch);
+            }
+            bool fits = encodeBlock(piece, pieceLength,
+                                    fileInfo.blockTables ? (ownTable ? &ownTable->huffTable : &noTable) : nullptr,
+                                    ownTable ? ownTable->codes : codes, fileInfo.streams, encoded);
+            if (!fits || encoded.size() - pieceStart > BLOCK_HEADER_SIZE + pieceLength) {
+                encoded.resize(pieceStart);
+                encodeRawBlock(piece, pieceLength, encoded);
+            } else if (!ownTable) {
+                usesFileTable = true;
+            }
+        }
+        if (fileInfo.checksum) {
+            crc = crc32cUpdate(crc, encoded.data() + pieceStart, encoded.size() - pieceStart);
+        }
+        piece += pieceLength;
+    }
+    return usesFileTable;
+}
+
+//Encodes a file of a single block on the calling thread, into encoded, since starting and stopping the
+//pipeline's threads would take longer than the block itself. The block is stored as it is when the file's
+//table would cost more than its codes save. Its CRC32C goes in checksum, with fileInfo.checksum. Returns
+//whether the block was coded with the file's table.
+bool encodeOnlyBlock(FileInfo &fileInfo, const CachedTable &table, EncodedBytes &encoded, uint32_t &checksum) {
+    uint64_t fileLength = fileInfo.fileStreamLength;
+    bool countExactly = samplesInput(fileInfo);
+    fileInfo.stats.byteCounts.assign(countExactly ? 256 : 0, 0);
+    encoded.clear();
+    uint32_t crc = CRC32C_INITIAL;
+    checksum = 0;
+    if (fileLength == 0) {
+        return false;
+    }
+    if (runGlyph(fileInfo) >= 0) {
+        fileInfo.stats.byteCounts.clear();
+        encodeRunBlock((char) runGlyph(fileInfo), (size_t) fileLength, encoded);
+        checksum = fileInfo.checksum ? crc32c(encoded.data(), encoded.size()) : 0;
+        return false;
+    }
+
+    const char *data = fileInfo.memory;
+    vector<char> original;
+    if (data == nullptr) {
+        original.resize((size_t) fileLength);
+        fileInfo.fileStream.clear();
+        fileInfo.fileStream.seekg(0, ios::beg);
+        if (!fileInfo.fileStream.read(original.data(), (std::streamsize) fileLength)) {
+            throw std::runtime_error("could not read " + fileInfo.fileName);
+        }
+        data = original.data();
+    }
+    if (countExactly) {
+        countBytes(data, (size_t) fileLength, fileInfo.stats.byteCounts);
+    }
+    TableScratch ownScratch;
+    TableScratch &scratch = fileInfo.tableScratch != nullptr ? *fileInfo.tableScratch : ownScratch;
+    bool usesFileTable = encodeBlockPieces(data, (size_t) fileLength, table.codes, fileInfo, scratch, encoded, crc);
+    if (usesFileTable && encoded.size() + blockTableSize(table.huffTable) > BLOCK_HEADER_SIZE + fileLength) {
+        encoded.clear();
+        encodeRawBlock(data, (size_t) fileLength, encoded);
+        crc = fileInfo.checksum ? crc32cUpdate(CRC32C_INITIAL, encoded.data(), encoded.size()) : crc;
+        usesFileTable = false;
+    }
+    checksum = fileInfo.checksum ? ~crc : 0;
+    return usesFileTable;
+}
+
+//Writes a file of one byte over and over (see runGlyph) as run blocks, from its counts alone: the input isn't
+//read again, and every full block comes out the same so it's encoded once. Returns a seek point for every block.
+template <class Writer>
+SeekIndex encodeRunFile(FileInfo &fileInfo, Writer &writer) {
+    const size_t blockSize = fileInfo.blockSize;
+    uint64_t fileLength = fileInfo.fileStreamLength;
+    SeekIndex index;
+    index.blockSize = (uint32_t) blockSize;
+    index.points.resize((size_t) ((fileLength + blockSize - 1) / blockSize));
+    fileInfo.stats.byteCounts.clear();
+
+    char glyph = (char) runGlyph(fileInfo);
+    string fullBlock;
+    EncodedBytes fullBytes(fullBlock);
+    encodeRunBlock(glyph, blockSize, fullBytes);
+    uint32_t fullChecksum = fileInfo.checksum ? crc32c(fullBlock.data(), fullBlock.size()) : 0;
+    uint64_t offset = 0;
+    for (size_t block = 0; block < index.points.size(); block++) {
+        size_t length = (size_t) std::min<uint64_t>(blockSize, fileLength - (uint64_t) block * blockSize);
+        const string *encoded = &fullBlock;
+        uint32_t checksum = fullChecksum;
+        string lastBlock;
+        if (length < blockSize) {
+            EncodedBytes lastBytes(lastBlock);
+            encodeRunBlock(glyph, length, lastBytes);
+            encoded = &lastBlock;
+            checksum = fileInfo.checksum ? crc32c(lastBlock.data(), lastBlock.size()) : 0;
+        }
+        writer.write(encoded->data(), encoded->size());
+        index.points[block].offset = offset;
+        index.points[block].checksum = checksum;
+        offset += encoded->size();
+    }
+    return index;
+}
+
+//Encodes the whole file as a three stage pipeline: a dispatcher thread hands out blocks, encoder workers read
+//and encode them in parallel, and the calling thread writes the finished blocks out in order. Stages are
+//connected by BoundedQueues and the dispatcher stops once a few blocks per worker are between it and the
+//writer, so memory stays bounded no matter how big the file is. Every worker reads into a buffer of its own
+//that it reuses block after block, so with fileInfo.pinWorkers the buffer is allocated on the worker's NUMA
+//node and is likely still in its cache. Input that's already in memory is encoded where it is. The writer is a
+//BufferedWriter, or the EncodedBytes of a caller's buffer. Returns a seek point for every block.
+template <class Writer>
+SeekIndex encodeBlocks(FileInfo &fileInfo, const vector<PackedCode> &codes, Writer &writer) {
+    const size_t blockSize = fileInfo.blockSize;
+    uint64_t fileLength = fileInfo.fileStreamLength;
+    size_t blockCount = (size_t) ((fileLength + blockSize - 1) / blockSize);
+    SeekIndex index;
+    index.blockSize = (uint32_t) blockSize;
+    index.points.resize(blockCount);
+
+    // When the table came from a sample, the blocks are also counted exactly so the cost of sampling can be
+    // reported afterwards
+    bool countExactly = samplesInput(fileInfo);
+    fileInfo.stats.byteCounts.assign(countExactly ? 256 : 0, 0);
+
+    if (blockCount == 0) {
+        return index;
+    }
+    if (runGlyph(fileInfo) >= 0) {
+        return encodeRunFile(fileInfo, writer);
+    }
+    int workerCount = (int) std::max<size_t>(1, std::min<size_t>(encoderWorkers(fileInfo), blockCount));
+    size_t maxBlocksInFlight = fileInfo.blocksInFlight > 0 ? fileInfo.blocksInFlight : 2 * workerCount + 2;
+
+    BoundedQueue<Block> toEncode(maxBlocksInFlight + workerCount);
+    BoundedQueue<Block> toWrite(maxBlocksInFlight);
+    std::atomic<bool> readFailed(false);
+
+    // One slot for every block that may be in flight: the dispatcher takes one before handing a block out and
+    // the writer gives it back once the block is written, so the dispatcher sleeps while they're all taken
+    BoundedQueue<bool> slots(maxBlocksInFlight);
+    for (size_t i = 0; i < maxBlocksInFlight; i++) {
+        slots.push(true);
+    }
+
+    std::thread dispatcher([&] {
+        for (size_t index = 0; index < blockCount; index++) {
+            slots.pop();
+
+            Block block;
+            block.index = index;
+            toEncode.push(std::move(block));
+        }
+        for (int i = 0; i < workerCount; i++) {
+            Block last;
+            last.index = NO_MORE_BLOCKS;
+            toEncode.push(std::move(last));
+        }
+    });
+
+    std::mutex countsMutex;
+
+    // Pinning only pays when the writer and every worker get a core to themselves. With fewer cores than
+    // threads, or cores another process has been pinned to as well, pinned threads would queue up behind each
+    // other where the scheduler could have moved them.
+    vector<int> cores = fileInfo.pinWorkers ? allowedCores() : vector<int>();
+    if (cores.size() != (size_t) workerCount + 1) {
+        cores.clear();
+    }
+    vector<std::thread> workers;
+    for (int i = 0; i < workerCount; i++) {
+        workers.push_back(std::thread([&] {
+            vector<uint64_t> byteCounts(256);
+            TableScratch scratch;
+            ifstream input;
+            if (fileInfo.memory == nullptr) {
+                input.open(fileInfo.fileName, ios::in | ios::binary);
+            }
+            vector<char> original;
+            while (true) {
+                Block block = toEncode.pop();
+                if (block.index == NO_MORE_BLOCKS) {
+                    break;
+                }
+                uint64_t start = (uint64_t) block.index * blockSize;
+                size_t length = (size_t) std::min<uint64_t>(blockSize, fileLength - start);
+                const char *data = fileInfo.memory + start;
+                if (fileInfo.memory == nullptr) {
+                    original.resize(length);
+                    input.seekg((std::streamoff) start, ios::beg);
+                    if (!input.read(original.data(), length)) {
+                        readFailed = true;
+                        input.clear();
+                    }
+                    data = original.data();
+                }
+                if (countExactly) {
+                    countBytes(data, length, byteCounts);
+                }
+                EncodedBytes encoded(block.encoded);
+                uint32_t crc = CRC32C_INITIAL;
+                encodeBlockPieces(data, length, codes, fileInfo, scratch, encoded, crc);
+                block.checksum = fileInfo.checksum ? ~crc : 0;
+                toWrite.push(std::move(block));
+            }
+            if (countExactly) {
+                std::lock_guard<std::mutex> lock(countsMutex);
+                for (int glyph = 0; glyph < 256; glyph++) {
+                    fileInfo.stats.byteCounts[glyph] += byteCounts[glyph];
+                }
+            }
+        }));
+        if (!cores.empty()) {
+            pinThread(workers.back(), cores[i + 1]);
+        }
+    }
+
+    // Blocks finish out of order; hold on to the early ones until their turn
+    map<size_t, Block> finished;
+    size_t nextIndex = 0;
+    uint64_t offset = 0;
+    while (nextIndex < blockCount) {
+        Block block = toWrite.pop();
+        finished[block.index] = std::move(block);
+
+        for (auto next = finished.find(nextIndex); next != finished.end(); next = finished.find(nextIndex)) {
+            writer.write(next->second.encoded.data(), next->second.encoded.size());
+            index.points[nextIndex].offset = offset;
+            index.points[nextIndex].checksum = next->second.checksum;
+            offset += next->second.encoded.size();
+            finished.erase(next);
+            nextIndex++;
+            slots.push(true);
+        }
+    }
+
+    dispatcher.join();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    if (readFailed) {
+        throw std::runtime_error("could not read " + fileInfo.fileName);
+    }
+
+    return index;
+}
+
+//How much bigger the codes came out than a table built from the exact byte counts would have made them,
+//0.01 meaning 1%. The exact table gets the same code length limit, so only the cost of sampling shows up.
+double samplingLoss(const vector<uint64_t> &byteCounts, const vector<PackedCode> &codes, int maxCodeLength) {
+    if (*std::max_element(byteCounts.begin(), byteCounts.end()) == 0) {
+        return 0;
+    }
+    vector<int> exactLengths = huffmanCodeLengths(buildLengthLimitedHuffmanTable(blockGlyphCounts(byteCounts), maxCodeLength));
+
+    uint64_t exactBits = 0;
+    uint64_t codeBits = 0;
+    for (int glyph = 0; glyph < 256; glyph++) {
+        exactBits += byteCounts[glyph] * exactLengths[glyph];
+        codeBits += byteCounts[glyph] * codes[glyph].length;
+    }
+    return exactBits > 0 ? (double) codeBits / exactBits - 1 : 0;
+}
+
+//Little-endian helpers for the .huf header, so a file written on one machine reads back the same on another.
+//They write to a stream or to EncodedBytes alike.
+template <class Output>
+void writeUint16(Output &fout, uint16_t value) {
+    unsigned char buffer[2] = {(unsigned char) (value & 0xFF), (unsigned char) (value >> 8)};
+    fout.write((char *) buffer, sizeof buffer);
+}
+
+template <class Output>
+void writeUint32(Output &fout, uint32_t value) {
+    writeUint16(fout, (uint16_t) (value & 0xFFFF));
+    writeUint16(fout, (uint16_t) (value >> 16));
+}
+
+template <class Output>
+void writeUint64(Output &fout, uint64_t value) {
+    writeUint32(fout, (uint32_t) (value & 0xFFFFFFFF));
+    writeUint32(fout, (uint32_t) (value >> 32));
+}
+
+uint16_t readUint16(const char *data, size_t length, size_t &position) {
+    if (position + 2 > length) {
+        throw std::runtime_error("unexpected end of file while reading header");
+    }
+    uint16_t value = (unsigned char) data[position] | ((unsigned char) data[position + 1] << 8);
+    position += 2;
+    return value;
+}
+
+uint32_t readUint32(const char *data, size_t length, size_t &position) {
+    uint32_t low = readUint16(data, length, position);
+    return low | ((uint32_t) readUint16(data, length, position) << 16);
+}
+
+uint64_t readUint64(const char *data, size_t length, size_t &position) {
+    uint64_t low = readUint32(data, length, position);
+    return low | ((uint64_t) readUint32(data, length, position) << 32);
+}
+
+//Bytes in the header of a .huf file (see writeHufFile) with a file name of nameLength bytes and a table of
+//entries entries: magic, version, flags and codec mode, original size, payload size and checksum, then the
+//name and the table, each after its 16-bit length
+uint64_t hufHeaderSize(size_t nameLength, size_t entries) {
+    return sizeof HUFF_MAGIC + 3 + 8 + 8 + 4 + 2 + nameLength + 2 + 6 * (uint64_t) entries;
+}
+
+//Where the payload size is in a .huf header, after the magic, version, flags, codec mode and original size.
+//The payload checksum follows it.
+const size_t PAYLOAD_SIZE_POSITION = sizeof HUFF_MAGIC + 3 + 8;
+
+//Bytes in the seek index (see writeSeekIndex) of a file of this many blocks
+uint64_t hufSeekIndexSize(size_t blocks) {
+    return 8 + SEEK_POINT_SIZE * (uint64_t) blocks;
+}
+
+//Writes the seek index that follows the payload of a CODEC_BLOCKS file: the block size and number of blocks
+//(32 bits each), then for every block its offset from the start of the payload (64 bits) and its CRC32C.
+template <class Output>
+void writeSeekIndex(Output &fout, const SeekIndex &index) {
+    writeUint32(fout, index.blockSize);
+    writeUint32(fout, (uint32_t) index.points.size());
+    for (const SeekPoint &point : index.points) {
+        writeUint64(fout, point.offset);
+        writeUint32(fout, point.checksum);
+    }
+}
+
+SeekIndex readSeekIndex(const char *data, size_t length) {
+    size_t position = 0;
+    SeekIndex index;
+    index.blockSize = readUint32(data, length, position);
+    uint32_t blockCount = readUint32(data, length, position);
+    if (index.blockSize == 0 || blockCount > (length - position) / SEEK_POINT_SIZE) {
+        throw std::runtime_error("bad seek index");
+    }
+    index.points.resize(blockCount);
+    for (SeekPoint &point : index.points) {
+        point.offset = readUint64(data, length, position);
+        point.checksum = readUint32(data, length, position);
+    }
+    return index;
+}
+
+//The CRC32C of a payload of blocks, put together from the checksums in its seek index without reading it again
+uint32_t payloadChecksum(const SeekIndex &index, uint64_t payloadSize) {
+    // The CRC32C of no bytes at all
+    uint32_t crc = ~CRC32C_INITIAL;
+    for (size_t block = 0; block < index.points.size(); block++) {
+        uint64_t end = block + 1 < index.points.size() ? index.points[block + 1].offset : payloadSize;
+        crc = crc32cCombine(crc, index.points[block].checksum, end - index.points[block].offset);
+    }
+    return crc;
+}
+
+//Writes the header of a .huf file (see writeHufFile), with a payload size and checksum of 0 to be filled in at
+//PAYLOAD_SIZE_POSITION once they're known. The table is left out unless withTable.
+template <class Output>
+void writeHufHeader(Output &fout, const FileInfo &fileInfo, const vector<HuffTableEntry> &huffTableEntries,
+                    bool oneBlock, bool withTable) {
+    int numberOfTableEntries = withTable ? huffTableEntries.size() : 0;
+    char format[3] = {(char) HUFF_FORMAT_VERSION,
+                      (char) ((fileInfo.checksum ? HUFF_FLAG_CHECKSUM : 0) | (oneBlock ? 0 : HUFF_FLAG_SEEK_INDEX) |
+                              HUFF_FLAG_RUN_BLOCKS | HUFF_FLAG_RAW_BLOCKS |
+                              (fileInfo.blockTables ? HUFF_FLAG_BLOCK_TABLES : 0) | (withTable ? 0 : HUFF_FLAG_NO_TABLE)),
+                      (char) (fileInfo.streams > 1 ? CODEC_INTERLEAVED : CODEC_BLOCKS)};
+    fout.write(HUFF_MAGIC, sizeof HUFF_MAGIC);
+    fout.write(format, sizeof format);
+    writeUint64(fout, fileInfo.fileStreamLength);
+    writeUint64(fout, 0);
+    writeUint32(fout, 0);
+    writeUint16(fout, (uint16_t) fileInfo.fileNameLength);
+    fout.write(fileInfo.fileName.c_str(), fileInfo.fileName.size());
+    writeUint16(fout, (uint16_t) numberOfTableEntries);
+
+    for (int i = 0; i < numberOfTableEntries; i++) {
+        writeUint16(fout, (uint16_t) huffTableEntries[i].glyph);
+        writeUint16(fout, (uint16_t) huffTableEntries[i].leftPointer);
+        writeUint16(fout, (uint16_t) huffTableEntries[i].rightPointer);
+    }
+}
+
+//Creates the .huf version of the file.
+//First writes out the magic, format version, flags and codec mode, the size of the original file, the size and
+//CRC32C of the compressed payload, the file name length, the file name itself, and then the number of
+//table entries. It then loops through the huffman table and prints out each glyph, left and right pointer in each
+//slot. A table never has more than 513 entries, so all of these fit in 16 bits (-1 is stored as 0xFFFF). Lastly, it
+//encodes the message with the table's codes straight into the file through a BufferedWriter (with outputBufferSize, 0 for a stream in
+//memory) and writes the seek index after it, then goes back and fills in the payload size and checksum, which
+//aren't known until the end.
+//A file of one block is encoded before anything is written, so when the file's table doesn't get used (the block
+//went out raw or as a run, or its pieces brought tables of their own) it can be left out (HUFF_FLAG_NO_TABLE).
+//One block leaves nothing for a seek index to skip, so that's left out too. Small inputs, which the table would
+//otherwise outweigh, then come out no more than the headers bigger than they went in.
+void writeHufFile(std::ostream &fout, FileInfo &fileInfo, const CachedTable &table,
+                  size_t outputBufferSize = OUTPUT_BUFFER_SIZE) {
+    const vector<PackedCode> &codes = table.codes;
+    bool oneBlock = fileInfo.fileStreamLength <= fileInfo.blockSize;
+    string encodedBlock;
+    EncodedBytes encoded(encodedBlock);
+    uint32_t checksum = 0;
+    bool withTable = oneBlock ? encodeOnlyBlock(fileInfo, table, encoded, checksum) : runGlyph(fileInfo) < 0;
+
+    std::streampos fileStart = fout.tellp();
+    writeHufHeader(fout, fileInfo, table.huffTable, oneBlock, withTable);
+
+    std::streampos payloadStart = fout.tellp();
+    BufferedWriter writer(fout, outputBufferSize);
+    SeekIndex index;
+    if (oneBlock) {
+        writer.write(encodedBlock.data(), encodedBlock.size());
+    } else {
+        index = encodeBlocks(fileInfo, codes, writer);
+    }
+    writer.finish();
+    fileInfo.stats.samplingLoss = fileInfo.stats.byteCounts.empty() ? 0 : samplingLoss(fileInfo.stats.byteCounts, codes,
+                                                                                        fileInfo.maxCodeLength);
+    uint64_t payloadSize = (uint64_t) (fout.tellp() - payloadStart);
+    if (!oneBlock) {
+        writeSeekIndex(fout, index);
+        checksum = fileInfo.checksum ? payloadChecksum(index, payloadSize) : 0;
+    }
+    std::streampos end = fout.tellp();
+
+    fout.seekp(fileStart + (std::streamoff) PAYLOAD_SIZE_POSITION);
+    writeUint64(fout, payloadSize);
+    writeUint32(fout, checksum);
+    fout.seekp(end);
+    fileInfo.stats.compressedSize = (uint64_t) (end - fileStart);
+    fileInfo.stats.peakMemory = peakResidentMemory();
+}
+
+//Writes the .huf version of the file into the capacity bytes at out, just as writeHufFile would write it, and
+//returns how many bytes it took. The payload is encoded where it goes, a bigger file a block at a time as the
+//pipeline finishes them. A file of one block is encoded before it's known whether the table goes in, so it goes
+//where it would with the table, and is moved up if the table isn't needed after all. In a buffer tighter than
+//compressBound asks for, it goes where it would without the table instead, so it fits whenever the file does.
+size_t writeHufSpan(FileInfo &fileInfo, const CachedTable &table, char *out, size_t capacity) {
+    bool oneBlock = fileInfo.fileStreamLength <= fileInfo.blockSize;
+    bool withTable = runGlyph(fileInfo) < 0 &&
+                     (!oneBlock || capacity >= compressBound((size_t) fileInfo.fileStreamLength));
+    size_t payloadStart = (size_t) hufHeaderSize(fileInfo.fileName.size(), withTable ? table.huffTable.size() : 0);
+    if (payloadStart > capacity) {
+        throw std::runtime_error("the output buffer is too small, compressBound says how big it needs to be");
+    }
+    EncodedBytes payload(out + payloadStart, capacity - payloadStart);
+    SeekIndex index;
+    uint32_t checksum = 0;
+    if (oneBlock) {
+        withTable = encodeOnlyBlock(fileInfo, table, payload, checksum);
+    } else {
+        index = encodeBlocks(fileInfo, table.codes, payload);
+        checksum = fileInfo.checksum ? payloadChecksum(index, payload.size()) : 0;
+    }
+    fileInfo.stats.samplingLoss = fileInfo.stats.byteCounts.empty() ? 0 : samplingLoss(fileInfo.stats.byteCounts,
+                                                                                        table.codes,
+                                                                                        fileInfo.maxCodeLength);
+
+    size_t headerSize = (size_t) hufHeaderSize(fileInfo.fileName.size(), withTable ? table.huffTable.size() : 0);
+    if (headerSize + payload.size() > capacity) {
+        throw std::runtime_error("the output buffer is too small, compressBound says how big it needs to be");
+    }
+    if (headerSize != payloadStart) {
+        memmove(out + headerSize, payload.data(), payload.size());
+    }
+    EncodedBytes header(out, headerSize);
+    writeHufHeader(header, fileInfo, table.huffTable, oneBlock, withTable);
+    EncodedBytes file(out, capacity);
+    file.resize(headerSize + payload.size());
+    if (!oneBlock) {
+        writeSeekIndex(file, index);
+    }
+
+    EncodedBytes sizes(out + PAYLOAD_SIZE_POSITION, 12);
+    writeUint64(sizes, (uint64_t) payload.size());
+    writeUint32(sizes, checksum);
+    fileInfo.stats.compressedSize = file.size();
+    return file.size();
+}
+
+//Works on every file in fileNames, filesAtOnce of them at a time, each on a thread of its own that takes the
+//next file when it's done with one. Every file gets a FileInfo named for it, with settings from setUp, and work
+//does what's to be done with it and returns what to print about it. What it throws (std::runtime_error) is
+//printed instead and the file counts as failed. Files are printed about one at a time, in the order they
+//finish. Returns how many failed.
+int forEachFile(const vector<string> &fileNames, size_t filesAtOnce, const std::function<void(FileInfo &)> &setUp,
+                const std::function<string(FileInfo &)> &work) {
+    std::atomic<size_t> nextFile(0);
+    std::atomic<int> failures(0);
+    std::mutex outputMutex;
+    vector<std::thread> threads;
+    for (size_t i = 0; i < filesAtOnce; i++) {
+        threads.push_back(std::thread([&] {
+            for (size_t file = nextFile++; file < fileNames.size(); file = nextFile++) {
+                FileInfo fileInfo;
+                fileInfo.fileName = fileNames[file];
+                fileInfo.fileNameLength = fileInfo.fileName.length();
+                setUp(fileInfo);
+                string report;
+                try {
+                    report = work(fileInfo);
+                } catch (const std::runtime_error &e) {
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    cerr << fileInfo.fileName << ": " << e.what() << endl;
+                    failures++;
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(outputMutex);
+                cout << report;
+            }
+        }));
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    return failures;
+}
+
+//The .huf file that compressing fileName writes: fileName with its extension, if it has one, swapped for .huf
+string hufFileName(const string &fileName) {
+    // Strips away any extension from filename. If there isn't one, then just creates
+    // a copy of the original filename. A dot in a directory name isn't an extension.
+    size_t pos = fileName.find_last_of(".");
+    size_t separator = fileName.find_last_of("/\\");
+    if (pos != string::npos && separator != string::npos && pos < separator) {
+        pos = string::npos;
+    }
+    return fileName.substr(0, pos) + ".huf";
+}
+
+//Whether the names a and b lead to the same file (the same name, a link or another path to it), so writing one
+//would destroy the other. False when either doesn't exist.
+bool sameFile(const string &a, const string &b) {
+#if defined(_WIN32)
+    HANDLE files[2];
+    BY_HANDLE_FILE_INFORMATION information[2];
+    bool opened = true;
+    for (int i = 0; i < 2; i++) {
+        files[i] = CreateFileA((i == 0 ? a : b).c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        opened = opened && files[i] != INVALID_HANDLE_VALUE && GetFileInformationByHandle(files[i], &information[i]);
+    }
+    for (HANDLE file : files) {
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+    }
+    return opened && information[0].dwVolumeSerialNumber == information[1].dwVolumeSerialNumber &&
+           information[0].nFileIndexHigh == information[1].nFileIndexHigh &&
+           information[0].nFileIndexLow == information[1].nFileIndexLow;
+#elif defined(__linux__)
+    struct stat statusA;
+    struct stat statusB;
+    return stat(a.c_str(), &statusA) == 0 && stat(b.c_str(), &statusB) == 0 && statusA.st_dev == statusB.st_dev &&
+           statusA.st_ino == statusB.st_ino;
+#else
+    return a == b;
+#endif
+}
+
+//Writes outputName through write, which is given the name to write to: a partial file next to outputName that
+//replaces it only once write returns. When write throws, the partial file is removed and outputName is left as
+//it was. Throws, without writing anything, when outputName is inputName's file, since that would be read and
+//destroyed at the same time.
+void writeFileSafely(const string &inputName, const string &outputName,
+                     const std::function<void(const string &)> &write) {
+    if (sameFile(inputName, outputName)) {
+        throw std::runtime_error("won't write " + outputName + " over the file it's made from");
+    }
+    string partialName = outputName + ".part";
+    try {
+        write(partialName);
+    } catch (...) {
+        std::remove(partialName.c_str());
+        throw;
+    }
+#if defined(_WIN32)
+    bool replaced = MoveFileExA(partialName.c_str(), outputName.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool replaced = std::rename(partialName.c_str(), outputName.c_str()) == 0;
+#endif
+    if (!replaced) {
+        std::remove(partialName.c_str());
+        throw std::runtime_error("could not write " + outputName);
+    }
+}
+
+//Writes all of an ofstream that write fills in to fileName, throwing when any of it couldn't be written
+void writeStream(const string &fileName, const std::function<void(ofstream &)> &write) {
+    ofstream fout(fileName, ios::out | ios::binary);
+    write(fout);
+    fout.close();
+    if (!fout) {
+        throw std::runtime_error("could not write " + fileName);
+    }
+}
+
+//Writes fileInfo's file out compressed, next to it with a .huf extension
+void createAndOutputFileInfo(FileInfo &fileInfo, const CachedTable &table) {
+    string outputName = hufFileName(fileInfo.fileName);
+    writeFileSafely(fileInfo.fileName, outputName, [&](const string &partialName) {
+        writeStream(partialName, [&](ofstream &fout) {
+            writeHufFile(fout, fileInfo, table);
+        });
+    });
+}
+
+//Compresses the file fileInfo names, with the settings it holds, to a .huf file next to it. With a memory
+//limit the settings are cut down to fit it first (see fitToMemory).
+void compressFile(FileInfo &fileInfo) {
+    loadFileContents(fileInfo);
+    if (!fileInfo.fileStream) {
+        throw std::runtime_error("could not open " + fileInfo.fileName);
+    }
+    if (fileInfo.maxMemory > 0) {
+        fitToMemory(fileInfo);
+    }
+    std::shared_ptr<const CachedTable> table = createHuffmanTable(fileInfo);
+
+    createAndOutputFileInfo(fileInfo, *table);
+
+    fileInfo.fileStream.close();
+}
+
+//Compresses every file in fileNames, each to its own .huf file. Several files are worked on at once, each with
+//a share of the encoder threads, so while one waits on a read or a write the others keep the cores busy; a
+//batch of small files would otherwise spend most of its time waiting on one file after another. setUp fills in
+//the settings of each file's FileInfo, and a memory limit in them is shared out between the files being worked
+//on at once. Files that would be written to the same .huf file (a.txt and a.csv both make a.huf) are left
+//alone and count as failures, rather than one quietly overwriting the other. Prints a line for every file and
+//returns how many of them failed.
+int compressFiles(const vector<string> &allFileNames, const std::function<void(FileInfo &)> &setUp) {
+    map<string, vector<string>> inputsOf;
+    for (const string &fileName : allFileNames) {
+        inputsOf[hufFileName(fileName)].push_back(fileName);
+    }
+    vector<string> fileNames;
+    int clashes = 0;
+    for (const string &fileName : allFileNames) {
+        const vector<string> &inputs = inputsOf[hufFileName(fileName)];
+        if (inputs.size() == 1) {
+            fileNames.push_back(fileName);
+            continue;
+        }
+        string others;
+        for (const string &other : inputs) {
+            if (other != fileName) {
+                others += (others.empty() ? "" : ", ") + other;
+            }
+        }
+        if (others.empty()) {
+            cerr << fileName << ": not compressed, it's named more than once" << endl;
+        } else {
+            cerr << fileName << ": not compressed, " << hufFileName(fileName) << " is where " << others
+                 << " would go too" << endl;
+        }
+        clashes++;
+    }
+
+    int cores = availableCores();
+    size_t filesAtOnce = std::min(fileNames.size(), (size_t) std::max(2, cores));
+    // No file's share of a memory limit is less than the least fitToMemory can work in, unless the whole limit
+    // is: with a tight limit fewer files go at once, rather than every one of them failing
+    const uint64_t minimumShare = encoderMemory(MIN_MEMORY_BLOCK_SIZE, 1, 2);
+    FileInfo settings;
+    setUp(settings);
+    if (settings.maxMemory > 0) {
+        filesAtOnce = (size_t) std::max<uint64_t>(1, std::min<uint64_t>(filesAtOnce, settings.maxMemory / minimumShare));
+    }
+    int workersPerFile = std::max(1, cores / (int) std::max<size_t>(1, filesAtOnce));
+
+    // Files at once would pin their workers to the same cores, so none of them are pinned
+    auto setUpShare = [&](FileInfo &fileInfo) {
+        setUp(fileInfo);
+        fileInfo.workers = workersPerFile;
+        fileInfo.pinWorkers = false;
+        fileInfo.maxMemory = std::max(fileInfo.maxMemory / filesAtOnce, std::min(fileInfo.maxMemory, minimumShare));
+    };
+    return clashes + forEachFile(fileNames, filesAtOnce, setUpShare, [](FileInfo &fileInfo) {
+        compressFile(fileInfo);
+        std::ostringstream report;
+        report << fileInfo.fileName << ": " << fileInfo.fileStreamLength << " -> " << fileInfo.stats.compressedSize
+               << " bytes" << endl;
+        return report.str();
+    });
+}
+
+// What analyzeFile predicts about compressing a file, without compressing it
+struct FileAnalysis {
+    uint64_t length = 0;
+    size_t blocks = 0;
+    int distinctBytes = 0;
+    double entropy = 0;                 // bits per byte, over the whole file
+    int shortestCode = 0;
+    int longestCode = 0;
+    double averageCodeLength = 0;       // bits per byte with the file's table
+    uint64_t headerSize = 0;            // header and table
+    uint64_t seekIndexSize = 0;
+    uint64_t payloadSize = 0;           // the blocks
+    double minBlockEntropy = 0;
+    double maxBlockEntropy = 0;
+    double blockEntropyDeviation = 0;   // standard deviation of the entropy of the blocks
+};
+
+//Shannon entropy of bytes with these counts, in bits per byte
+double entropyPerByte(const vector<uint64_t> &counts) {
+    double total = 0;
+    for (int glyph = 0; glyph < 256; glyph++) {
+        total += counts[glyph];
+    }
+    double bits = 0;
+    for (int glyph = 0; glyph < 256; glyph++) {
+        if (counts[glyph] > 0) {
+            bits += counts[glyph] * std::log2(total / counts[glyph]);
+        }
+    }
+    return total > 0 ? bits / total : 0;
+}
+
+//Bytes a block of length bytes with these counts should come out as, going the way encodeBlockPieces would: a
+//run block, the file's codes or its own table (see estimateBlockBits), or stored as it is if that's smaller.
+//usesFileTable is set to whether it comes out coded with the file's table.
+uint64_t predictBlockSize(const vector<uint64_t> &counts, size_t length, const vector<PackedCode> &fileCodes,
+                          const FileInfo &fileInfo, bool &usesFileTable) {
+    usesFileTable = false;
+    if (countGlyphs(counts) == 1) {
+        return BLOCK_HEADER_SIZE + 1;
+    }
+    uint64_t fileTableBits = 8 * (BLOCK_HEADER_SIZE + (fileInfo.blockTables ? 2 : 0) + 4 * (fileInfo.streams - 1)) +
+                             fileCodeBits(counts, fileCodes);
+    TableScratch scratch;
+    uint64_t bits = fileInfo.blockTables
+                        ? estimateBlockBits(counts, fileCodes, fileInfo.maxCodeLength, fileInfo.streams, scratch)
+                        : fileTableBits;
+    if ((bits + 7) / 8 >= BLOCK_HEADER_SIZE + length) {
+        return BLOCK_HEADER_SIZE + length;
+    }
+    usesFileTable = bits == fileTableBits;
+    return (bits + 7) / 8;
+}
+
+//Reads fileInfo's file from the start a block at a time, and hands the byte counts (256 entries) and length of
+//each block to blockCounted
+void countEveryBlock(FileInfo &fileInfo, const std::function<void(const vector<uint64_t> &, size_t)> &blockCounted) {
+    fileInfo.fileStream.clear();
+    fileInfo.fileStream.seekg(0, ios::beg);
+    vector<uint64_t> counts(256);
+    vector<char> chunk(INPUT_CHUNK_SIZE);
+    for (uint64_t blockStart = 0; blockStart < fileInfo.fileStreamLength; blockStart += fileInfo.blockSize) {
+        size_t length = (size_t) std::min<uint64_t>(fileInfo.blockSize, fileInfo.fileStreamLength - blockStart);
+        counts.assign(256, 0);
+        for (size_t remaining = length; remaining > 0;) {
+            size_t count = std::min(remaining, chunk.size());
+            if (!fileInfo.fileStream.read(chunk.data(), count)) {
+                throw std::runtime_error("could not read " + fileInfo.fileName);
+            }
+            countBytes(chunk.data(), count, counts);
+            remaining -= count;
+        }
+        blockCounted(counts, length);
+    }
+}
+
+//Predicts what compressing fileInfo's file with its settings would give, from the counting pass and the table
+//build alone. The file is read twice, a block at a time, so only one block's counts are held at once: the first
+//pass counts the whole file, for its table built from exact counts even at a level that samples, and measures
+//how much the blocks differ from each other; the second predicts the size of each block with that table.
+//Splitting blocks (levels 5 and up) isn't tried, so the prediction for those levels errs on the big side.
+FileAnalysis analyzeFile(FileInfo &fileInfo) {
+    loadFileContents(fileInfo);
+    if (!fileInfo.fileStream) {
+        throw std::runtime_error("could not open " + fileInfo.fileName);
+    }
+    FileAnalysis analysis;
+    analysis.length = fileInfo.fileStreamLength;
+    analysis.blocks = (size_t) ((analysis.length + fileInfo.blockSize - 1) / fileInfo.blockSize);
+
+    vector<uint64_t> glyphCounts(257);
+    double entropySum = 0;
+    double entropySquares = 0;
+    size_t block = 0;
+    countEveryBlock(fileInfo, [&](const vector<uint64_t> &counts, size_t) {
+        for (int glyph = 0; glyph < 256; glyph++) {
+            glyphCounts[glyph] += counts[glyph];
+        }
+        double entropy = entropyPerByte(counts);
+        analysis.minBlockEntropy = block++ == 0 ? entropy : std::min(analysis.minBlockEntropy, entropy);
+        analysis.maxBlockEntropy = std::max(analysis.maxBlockEntropy, entropy);
+        entropySum += entropy;
+        entropySquares += entropy * entropy;
+    });
+    glyphCounts[256] = 1;
+    if (analysis.blocks > 0) {
+        double mean = entropySum / analysis.blocks;
+        analysis.blockEntropyDeviation = std::sqrt(std::max(0.0, entropySquares / analysis.blocks - mean * mean));
+    }
+
+    analysis.distinctBytes = countGlyphs(glyphCounts) - 1;
+    analysis.entropy = entropyPerByte(glyphCounts);
+    std::shared_ptr<const CachedTable> table;
+    if (analysis.distinctBytes <= 1) {
+        table = loneLeafTable(glyphCounts);
+    } else if (fileInfo.tableCache != nullptr) {
+        table = fileInfo.tableCache->table(glyphCounts, fileInfo.maxCodeLength);
+    } else {
+        table = buildCachedTable(glyphCounts, fileInfo.maxCodeLength);
+    }
+
+    uint64_t codeBits = 0;
+    for (int glyph = 0; glyph < 256; glyph++) {
+        if (glyphCounts[glyph] == 0) {
+            continue;
+        }
+        int length = table->codes[glyph].length;
+        analysis.shortestCode = analysis.shortestCode == 0 ? length : std::min(analysis.shortestCode, length);
+        analysis.longestCode = std::max(analysis.longestCode, length);
+        codeBits += glyphCounts[glyph] * length;
+    }
+    analysis.averageCodeLength = analysis.length > 0 ? (double) codeBits / analysis.length : 0;
+
+    bool tableUsed = false;
+    countEveryBlock(fileInfo, [&](const vector<uint64_t> &counts, size_t length) {
+        bool usesFileTable;
+        analysis.payloadSize += predictBlockSize(counts, length, table->codes, fileInfo, usesFileTable);
+        tableUsed = tableUsed || usesFileTable;
+    });
+    fileInfo.fileStream.close();
+
+    // A file of one block leaves out the seek index, and the table too unless the block is coded with it and
+    // that beats storing the block as it is (see writeHufFile and encodeOnlyBlock)
+    bool oneBlock = analysis.blocks <= 1;
+    if (oneBlock && tableUsed &&
+        analysis.payloadSize + blockTableSize(table->huffTable) > BLOCK_HEADER_SIZE + analysis.length) {
+        analysis.payloadSize = BLOCK_HEADER_SIZE + analysis.length;
+        tableUsed = false;
+    }
+    bool withTable = !oneBlock || tableUsed;
+    analysis.headerSize = hufHeaderSize(fileInfo.fileName.size(), withTable ? table->huffTable.size() : 0);
+    analysis.seekIndexSize = oneBlock ? 0 : hufSeekIndexSize(analysis.blocks);
+    return analysis;
+}
+
+//Analyzes every file in fileNames (see analyzeFile), several at once, and prints what it found for each.
+//setUp fills in the settings to predict for. Returns how many files couldn't be analyzed.
+int analyzeFiles(const vector<string> &fileNames, const std::function<void(FileInfo &)> &setUp) {
+    size_t filesAtOnce = std::min(fileNames.size(), (size_t) availableCores());
+    return forEachFile(fileNames, filesAtOnce, setUp, [](FileInfo &fileInfo) {
+        FileAnalysis analysis = analyzeFile(fileInfo);
+        uint64_t predicted = analysis.headerSize + analysis.seekIndexSize + analysis.payloadSize;
+        double percent = analysis.length > 0 ? 100.0 * predicted / analysis.length : 0;
+        std::ostringstream report;
+        report << std::fixed << std::setprecision(2);
+        report << fileInfo.fileName << ": " << analysis.length << " bytes in " << analysis.blocks
+               << (analysis.blocks == 1 ? " block of " : " blocks of ") << fileInfo.blockSize / 1024 << " KB" << endl;
+        report << "  entropy " << analysis.entropy << " bits/byte over " << analysis.distinctBytes << " distinct bytes"
+               << endl;
+        report << "  codes " << analysis.shortestCode << " to " << analysis.longestCode << " bits, "
+               << analysis.averageCodeLength << " on average" << endl;
+        report << "  predicted size " << predicted << " bytes (" << percent << "%): " << analysis.headerSize
+               << " of header and table, " << analysis.seekIndexSize << " of seek index, " << analysis.payloadSize
+               << " of blocks" << endl;
+        report << "  block entropy " << analysis.minBlockEntropy << " to " << analysis.maxBlockEntropy
+               << " bits/byte, deviation " << analysis.blockEntropyDeviation << endl;
+        return report.str();
+    });
+}
+
+//Reads the header of a .huf file. data holds the start of the file (at least the header) and fileSize is the
+//size of the whole file. Every layout since the original one (32-bit fields, no magic) is understood. Sizes
+//and flags missing from older versions are filled in so that callers don't have to care which version they got.
+void readHufFileHeader(const char *data, size_t length, uint64_t fileSize, HufFileHeader &header) {
+    header.fileSize = fileSize;
+    header.flags = 0;
+    header.codecMode = CODEC_HUFFMAN;
+    header.originalSize = 0;
+    header.payloadSize = 0;
+    header.payloadChecksum = 0;
+    size_t position = 0;
+    int fileNameLength;
+    int numberOfTableEntries;
+
+    bool hasMagic = length >= sizeof HUFF_MAGIC && memcmp(data, HUFF_MAGIC, sizeof HUFF_MAGIC) == 0;
+    if (hasMagic) {
+        position = sizeof HUFF_MAGIC;
+        if (position >= length) {
+            throw std::runtime_error("unexpected end of file while reading header");
+        }
+        header.formatVersion = (unsigned char) data[position++];
+        if (header.formatVersion < 2 || header.formatVersion > HUFF_FORMAT_VERSION) {
+            throw std::runtime_error("unsupported .huf format version " + std::to_string(header.formatVersion));
+        }
+        if (header.formatVersion >= 3) {
+            if (position + 2 > length) {
+                throw std::runtime_error("unexpected end of file while reading header");
+            }
+            header.flags = (unsigned char) data[position++];
+            header.codecMode = (unsigned char) data[position++];
+            header.originalSize = readUint64(data, length, position);
+            header.payloadSize = readUint64(data, length, position);
+            header.payloadChecksum = readUint32(data, length, position);
+            if (header.codecMode > CODEC_INTERLEAVED) {
+                throw std::runtime_error("unsupported codec mode " + std::to_string(header.codecMode));
+            }
+        }
+        fileNameLength = readUint16(data, length, position);
+    } else {
+        header.formatVersion = 1;
+        fileNameLength = (int32_t) readUint32(data, length, position);
+    }
+
+    if (fileNameLength < 0 || position + fileNameLength > length) {
+        throw std::runtime_error("bad file name length in header");
+    }
+    header.fileName.assign(data + position, fileNameLength);
+    position += fileNameLength;
+
+    numberOfTableEntries = hasMagic ? readUint16(data, length, position) : (int32_t) readUint32(data, length, position);
+    if ((header.flags & HUFF_FLAG_NO_TABLE) ? numberOfTableEntries != 0 || header.codecMode == CODEC_HUFFMAN
+                                            : numberOfTableEntries < 1 || numberOfTableEntries > MAX_TABLE_ENTRIES) {
+        throw std::runtime_error("bad huffman table size in header");
+    }
+
+    header.huffTable.resize(numberOfTableEntries);
+    for (int i = 0; i < numberOfTableEntries; i++) {
+        if (hasMagic) {
+            header.huffTable[i].glyph = (int16_t) readUint16(data, length, position);
+            header.huffTable[i].leftPointer = (int16_t) readUint16(data, length, position);
+            header.huffTable[i].rightPointer = (int16_t) readUint16(data, length, position);
+        } else {
+            header.huffTable[i].glyph = (int32_t) readUint32(data, length, position);
+            header.huffTable[i].leftPointer = (int32_t) readUint32(data, length, position);
+            header.huffTable[i].rightPointer = (int32_t) readUint32(data, length, position);
+        }
+    }
+
+    header.payloadOffset = position;
+    uint64_t available = fileSize - position;
+    if (header.formatVersion < 3) {
+        header.payloadSize = available;
+    } else if ((header.flags & HUFF_FLAG_SEEK_INDEX) ? header.payloadSize > available : header.payloadSize != available) {
+        throw std::runtime_error("compressed data is " + std::to_string(available) +
+                                 " bytes, header says " + std::to_string(header.payloadSize));
+    }
+}
+
+HufFileHeader readHufFileHeader(const char *data, size_t length, uint64_t fileSize) {
+    HufFileHeader header;
+    readHufFileHeader(data, length, fileSize, header);
+    return header;
+}
+
+//The same, from a string holding the start of the file
+HufFileHeader readHufFileHeader(const string &data, uint64_t fileSize) {
+    return readHufFileHeader(data.data(), data.size(), fileSize);
+}
+
+//Lays the huffman table out as a DecodeNode array. Nodes are visited breadth first and every internal node
+//gets its two children allocated as a pair, which keeps siblings adjacent and the top levels of the tree in
+//the first few cache lines. Throws if the pointers in the table don't form a proper tree. The tree is built
+//into nodes, over whatever they held.
+void buildDecodeTree(const vector<HuffTableEntry> &huffTable, vector<DecodeNode> &nodes) {
+    if (huffTable.size() > (size_t) MAX_TABLE_ENTRIES) {
+        throw std::runtime_error("huffman table is too big");
+    }
+    nodes.assign(1, DecodeNode());
+    // No tree has more nodes than the table has entries
+    int tableIndexOfNode[MAX_TABLE_ENTRIES];
+    tableIndexOfNode[0] = 0;
+
+    for (size_t n = 0; n < nodes.size(); n++) {
+        const HuffTableEntry &entry = huffTable[tableIndexOfNode[n]];
+
+        if (entry.leftPointer == -1 && entry.rightPointer == -1) {
+            if (entry.glyph < 0 || entry.glyph > 256) {
+                throw std::runtime_error("bad glyph in huffman table");
+            }
+            nodes[n].glyph = (uint16_t) entry.glyph;
+            continue;
+        }
+
+        int tableSize = huffTable.size();
+        if (entry.leftPointer < 0 || entry.leftPointer >= tableSize ||
+            entry.rightPointer < 0 || entry.rightPointer >= tableSize || nodes.size() + 2 > huffTable.size()) {
+            throw std::runtime_error("bad pointer in huffman table");
+        }
+
+        nodes[n].firstChild = (uint16_t) nodes.size();
+        tableIndexOfNode[nodes.size()] = entry.leftPointer;
+        tableIndexOfNode[nodes.size() + 1] = entry.rightPointer;
+        nodes.resize(nodes.size() + 2);
+    }
+}
+
+//Builds the lookup table on top of the decode tree by walking the tree with every possible tableBits bit
+//pattern, first bit in bit 0. The table is DECODE_TABLE_BITS wide unless every code fits a smaller one. The
+//missing table of a file with HUFF_FLAG_NO_TABLE gets a decoder with no nodes, which decodeBlock turns away.
+//The decoder is built over whatever decoder held before, keeping its memory.
+void buildDecoder(const vector<HuffTableEntry> &huffTable, Decoder &decoder) {
+    decoder.nodes.clear();
+    decoder.table.clear();
+    decoder.pairs.clear();
+    decoder.maxCodeLength = 0;
+    decoder.tableBits = DECODE_TABLE_BITS;
+    if (huffTable.empty()) {
+        return;
+    }
+    buildDecodeTree(huffTable, decoder.nodes);
+    if (decoder.nodes[0].glyph != NO_GLYPH) {
+        decoder.table.resize(1 << decoder.tableBits);
+        return;
+    }
+
+    // Nodes are stored breadth first, so depths can be filled in front to back
+    int depth[MAX_TABLE_ENTRIES] = {};
+    for (size_t n = 0; n < decoder.nodes.size(); n++) {
+        if (decoder.nodes[n].glyph == NO_GLYPH) {
+            depth[decoder.nodes[n].firstChild] = depth[decoder.nodes[n].firstChild + 1] = depth[n] + 1;
+        }
+        decoder.maxCodeLength = std::max(decoder.maxCodeLength, depth[n]);
+    }
+
+    if (decoder.maxCodeLength <= SMALL_DECODE_TABLE_BITS) {
+        decoder.tableBits = SMALL_DECODE_TABLE_BITS;
+    }
+    decoder.table.resize(1 << decoder.tableBits);
+    for (int bits = 0; bits < (1 << decoder.tableBits); bits++) {
+        DecodeTableEntry &entry = decoder.table[bits];
+        int node = 0;
+        for (int length = 1; length <= decoder.tableBits; length++) {
+            node = decoder.nodes[node].firstChild + ((bits >> (length - 1)) & 1);
+            if (decoder.nodes[node].glyph != NO_GLYPH) {
+                entry.glyph = decoder.nodes[node].glyph;
+                entry.length = (uint8_t) length;
+                break;
+            }
+        }
+        if (entry.glyph == NO_GLYPH) {
+            entry.node = (uint16_t) node;
+            entry.length = (uint8_t) decoder.tableBits;
+        }
+    }
+
+    // A code that leaves enough of the table's bits for a whole second code can be looked up together with it.
+    // The bits after the first code are only tableBits - length long, so the second lookup is only valid
+    // when its code fits in those.
+    decoder.pairs.resize(1 << decoder.tableBits);
+    for (int bits = 0; bits < (1 << decoder.tableBits); bits++) {
+        const DecodeTableEntry &first = decoder.table[bits];
+        DecodePair &pair = decoder.pairs[bits];
+        if (first.glyph > 255) {
+            continue;
+        }
+        pair.glyphs[0] = (uint8_t) first.glyph;
+        pair.count = 1;
+        pair.length = first.length;
+
+        const DecodeTableEntry &second = decoder.table[bits >> first.length];
+        if (second.glyph <= 255 && first.length + second.length <= decoder.tableBits) {
+            pair.glyphs[1] = (uint8_t) second.glyph;
+            pair.count = 2;
+            pair.length = (uint8_t) (first.length + second.length);
+        }
+    }
+}
+
+//The same, into a decoder of its own
+Decoder buildDecoder(const vector<HuffTableEntry> &huffTable) {
+    Decoder decoder;
+    buildDecoder(huffTable, decoder);
+    return decoder;
+}
+
+//Hash of the glyphs and pointers of a huffman table, what a TableCache looks its decoder up by
+uint64_t huffmanTableHash(const vector<HuffTableEntry> &huffTable) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const HuffTableEntry &entry : huffTable) {
+        uint64_t fields = (uint64_t) (uint16_t) entry.glyph | (uint64_t) (uint16_t) entry.leftPointer << 16 |
+                          (uint64_t) (uint16_t) entry.rightPointer << 32;
+        hash = (hash ^ fields) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+//Whether two huffman tables have the same glyphs and pointers, whatever their frequencies
+bool sameHuffmanTable(const vector<HuffTableEntry> &a, const vector<HuffTableEntry> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].glyph != b[i].glyph || a[i].leftPointer != b[i].leftPointer || a[i].rightPointer != b[i].rightPointer) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::shared_ptr<const Decoder> TableCache::decoder(const vector<HuffTableEntry> &huffTable) {
+    uint64_t hash = huffmanTableHash(huffTable);
+    std::shared_ptr<const CachedDecoder> cached;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cached = decoders.find(hash);
+    }
+    if (cached && sameHuffmanTable(cached->huffTable, huffTable)) {
+        return std::shared_ptr<const Decoder>(cached, &cached->decoder);
+    }
+
+    std::shared_ptr<CachedDecoder> built;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        built = std::move(spareDecoder);
+    }
+    if (!built) {
+        built = std::make_shared<CachedDecoder>();
+    }
+    built->huffTable.assign(huffTable.begin(), huffTable.end());
+    buildDecoder(huffTable, built->decoder);
+    std::lock_guard<std::mutex> lock(mutex);
+    keepSpare(decoders.add(hash, built), spareDecoder);
+    return std::shared_ptr<const Decoder>(built, &built->decoder);
+}
+
+// Reads one bitstream of a block, least significant bit first. Reading past the end gives 0 bits; callers
+// check overran() once they are done with the stream.
+struct BitReader {
+    const unsigned char *data;
+    size_t size;
+    size_t bitPosition = 0;
+
+    BitReader() : data(nullptr), size(0) {}
+    BitReader(const unsigned char *data, size_t size) : data(data), size(size) {}
+
+    //The next 57 or more bits of the stream, starting in bit 0, without checking for the end of the stream.
+    //Only for use while safeSymbols() says so. Assumes a little-endian machine, like every target this builds for.
+    uint64_t peekUnchecked() const {
+        uint64_t window;
+        memcpy(&window, data + (bitPosition >> 3), sizeof window);
+        return window >> (bitPosition & 7);
+    }
+
+    //How many more codes of up to maxCodeLength bits can be read with peekUnchecked() before the 8 byte
+    //loads could run past the end of the stream
+    size_t safeSymbols(int maxCodeLength) const {
+        if (size < 8 || (bitPosition >> 3) + 8 > size) {
+            return 0;
+        }
+        return ((size - 8) * 8 - bitPosition) / maxCodeLength;
+    }
+
+    //Same as peekUnchecked(), but gives 0 bits past the end of the stream
+    uint64_t peek() const {
+        size_t byte = bitPosition >> 3;
+        uint64_t window = 0;
+        if (byte + 8 <= size) {
+            memcpy(&window, data + byte, sizeof window);
+        } else {
+            for (size_t i = 0; byte + i < size && i < 8; i++) {
+                window |= (uint64_t) data[byte + i] << (8 * i);
+            }
+        }
+        return window >> (bitPosition & 7);
+    }
+
+    bool overran() const {
+        return bitPosition > size * 8;
+    }
+};
+
+//Finishes a code longer than the lookup table by walking the tree from where the table left off
+int decodeLongCode(BitReader &reader, const Decoder &decoder, const DecodeTableEntry &entry) {
+    reader.bitPosition += decoder.tableBits;
+    int node = entry.node;
+    do {
+        node = decoder.nodes[node].firstChild + (int) (reader.peek() & 1);
+        reader.bitPosition++;
+    } while (decoder.nodes[node].glyph == NO_GLYPH);
+    return decoder.nodes[node].glyph;
+}
+
+//Slow path: decodes one glyph with bounds checked reads
+inline int decodeSymbol(BitReader &reader, const Decoder &decoder) {
+    const DecodeTableEntry &entry = decoder.table[reader.peek() & ((1 << decoder.tableBits) - 1)];
+    if (entry.glyph == NO_GLYPH) {
+        return decodeLongCode(reader, decoder, entry);
+    }
+    reader.bitPosition += entry.length;
+    return entry.glyph;
+}
+
+//Decoding loops, specialized at compile time on the longest code they handle, the width of the lookup table
+//and the number of streams per block, so the compiler can unroll them for each case. Every lookup goes to the
+//pair table first, so short codes come out two at a time. When no code is longer than the table, the tree
+//walk is compiled out and several lookups come out of every 57-bit load; ANY_CODE_LENGTH handles every table,
+//one lookup per load. Pick one with findDecodeKernel.
+template <int MaxCodeLength, int TableBits>
+struct DecodeKernel {
+    static const bool SHORT_CODES = MaxCodeLength <= TableBits;
+    static const int LOOKUPS_PER_LOAD = SHORT_CODES ? 57 / TableBits : 1;
+    static const size_t MAX_GLYPHS_PER_LOAD = 2 * LOOKUPS_PER_LOAD;
+    static const uint64_t TABLE_MASK = (1 << TableBits) - 1;
+
+    //Fast path: one unchecked load, then a pair table lookup and a shift for every one or two glyphs. Writes
+    //up to MAX_GLYPHS_PER_LOAD glyphs to out and returns how many. The only branch is for the eof glyph and
+    //codes longer than the table, which the lookup table and the tree walk finish.
+    static inline size_t decodeLoad(BitReader &reader, const Decoder &decoder, char *out) {
+        uint64_t window = reader.peekUnchecked();
+        size_t consumed = 0;
+        char *next = out;
+        for (int k = 0; k < LOOKUPS_PER_LOAD; k++) {
+            const DecodePair &pair = decoder.pairs[window & TABLE_MASK];
+            if (pair.count == 0) {
+                const DecodeTableEntry &entry = decoder.table[window & TABLE_MASK];
+                if (!SHORT_CODES && entry.glyph == NO_GLYPH) {
+                    reader.bitPosition += consumed;
+                    *next++ = (char) decodeLongCode(reader, decoder, entry);
+                    return next - out;
+                }
+                *next++ = (char) entry.glyph;
+                window >>= entry.length;
+                consumed += entry.length;
+                continue;
+            }
+            memcpy(next, pair.glyphs, 2);
+            next += pair.count;
+            window >>= pair.length;
+            consumed += pair.length;
+        }
+        reader.bitPosition += consumed;
+        return next - out;
+    }
+
+    //Decodes count glyphs from one stream. The bulk runs in batches the stream is guaranteed to have the bytes
+    //for, with no end of stream or end of data checks at all; only the last few bytes of the stream go through
+    //the slow path.
+    static void decodeStream(BitReader &reader, const Decoder &decoder, char *out, size_t count) {
+        size_t i = 0;
+        while (count - i >= MAX_GLYPHS_PER_LOAD) {
+            size_t end = i + std::min(count - i, reader.safeSymbols(decoder.maxCodeLength));
+            if (end - i < MAX_GLYPHS_PER_LOAD) {
+                break;
+            }
+            while (i + MAX_GLYPHS_PER_LOAD <= end) {
+                i += decodeLoad(reader, decoder, out + i);
+            }
+        }
+        for (; i < count; i++) {
+            out[i] = (char) decodeSymbol(reader, decoder);
+        }
+    }
+
+    //Decodes counts[stream] glyphs from each of four streams, taking from each in turn so the four lookups
+    //don't depend on each other. Streams go at their own pace; once one of them is near its end, the others are
+    //finished one at a time by decodeStream.
+    static void decodeFourStreams(BitReader *readers, const Decoder &decoder, char **out, const size_t *counts) {
+        BitReader &reader0 = readers[0], &reader1 = readers[1], &reader2 = readers[2], &reader3 = readers[3];
+        char *out0 = out[0], *out1 = out[1], *out2 = out[2], *out3 = out[3];
+        size_t done0 = 0, done1 = 0, done2 = 0, done3 = 0;
+
+        while (true) {
+            size_t done[4] = {done0, done1, done2, done3};
+            size_t end[4];
+            bool room = true;
+            for (int stream = 0; stream < 4 && room; stream++) {
+                room = counts[stream] - done[stream] >= MAX_GLYPHS_PER_LOAD;
+                if (room) {
+                    end[stream] = done[stream] + std::min(counts[stream] - done[stream],
+                                                          readers[stream].safeSymbols(decoder.maxCodeLength));
+                    room = end[stream] - done[stream] >= MAX_GLYPHS_PER_LOAD;
+                }
+            }
+            if (!room) {
+                break;
+            }
+            while (done0 + MAX_GLYPHS_PER_LOAD <= end[0] && done1 + MAX_GLYPHS_PER_LOAD <= end[1] &&
+                   done2 + MAX_GLYPHS_PER_LOAD <= end[2] && done3 + MAX_GLYPHS_PER_LOAD <= end[3]) {
+                done0 += decodeLoad(reader0, decoder, out0 + done0);
+                done1 += decodeLoad(reader1, decoder, out1 + done1);
+                done2 += decodeLoad(reader2, decoder, out2 + done2);
+                done3 += decodeLoad(reader3, decoder, out3 + done3);
+            }
+        }
+
+        decodeStream(reader0, decoder, out0 + done0, counts[0] - done0);
+        decodeStream(reader1, decoder, out1 + done1, counts[1] - done1);
+        decodeStream(reader2, decoder, out2 + done2, counts[2] - done2);
+        decodeStream(reader3, decoder, out3 + done3, counts[3] - done3);
+    }
+};
+
+//Decodes the length glyphs of a block (or of a whole CODEC_HUFFMAN payload) from its Streams streams into out
+template <int MaxCodeLength, int TableBits, int Streams>
+void decodeStreams(BitReader *readers, const Decoder &decoder, char *out, size_t length) {
+    typedef DecodeKernel<MaxCodeLength, TableBits> Kernel;
+    if (Streams == INTERLEAVED_STREAMS) {
+        size_t segment = (length + INTERLEAVED_STREAMS - 1) / INTERLEAVED_STREAMS;
+        char *outs[INTERLEAVED_STREAMS];
+        size_t counts[INTERLEAVED_STREAMS];
+        for (int stream = 0; stream < INTERLEAVED_STREAMS; stream++) {
+            outs[stream] = out + std::min(length, segment * stream);
+            counts[stream] = streamLength(length, INTERLEAVED_STREAMS, stream);
+        }
+        Kernel::decodeFourStreams(readers, decoder, outs, counts);
+    } else {
+        for (int stream = 0; stream < Streams; stream++) {
+            size_t count = streamLength(length, Streams, stream);
+            Kernel::decodeStream(readers[stream], decoder, out, count);
+            out += count;
+        }
+    }
+}
+
+typedef void (*DecodeStreamsFunction)(BitReader *readers, const Decoder &decoder, char *out, size_t length);
+
+// The decodeStreams instantiations there are, most specialized first
+struct DecodeKernelEntry {
+    int maxCodeLength;
+    int tableBits;
+    int streams;
+    DecodeStreamsFunction decode;
+};
+
+const DecodeKernelEntry DECODE_KERNELS[] = {
+    {SMALL_DECODE_TABLE_BITS, SMALL_DECODE_TABLE_BITS, 1, decodeStreams<SMALL_DECODE_TABLE_BITS, SMALL_DECODE_TABLE_BITS, 1>},
+    {SMALL_DECODE_TABLE_BITS, SMALL_DECODE_TABLE_BITS, INTERLEAVED_STREAMS,
+     decodeStreams<SMALL_DECODE_TABLE_BITS, SMALL_DECODE_TABLE_BITS, INTERLEAVED_STREAMS>},
+    {DECODE_TABLE_BITS, DECODE_TABLE_BITS, 1, decodeStreams<DECODE_TABLE_BITS, DECODE_TABLE_BITS, 1>},
+    {DECODE_TABLE_BITS, DECODE_TABLE_BITS, INTERLEAVED_STREAMS,
+     decodeStreams<DECODE_TABLE_BITS, DECODE_TABLE_BITS, INTERLEAVED_STREAMS>},
+    {ANY_CODE_LENGTH, DECODE_TABLE_BITS, 1, decodeStreams<ANY_CODE_LENGTH, DECODE_TABLE_BITS, 1>},
+    {ANY_CODE_LENGTH, DECODE_TABLE_BITS, INTERLEAVED_STREAMS,
+     decodeStreams<ANY_CODE_LENGTH, DECODE_TABLE_BITS, INTERLEAVED_STREAMS>},
+};
+
+//Picks the most specialized decoding loop that can handle decoder's table and the given number of streams
+DecodeStreamsFunction findDecodeKernel(const Decoder &decoder, int streams) {
+    for (const DecodeKernelEntry &kernel : DECODE_KERNELS) {
+        if (decoder.maxCodeLength <= kernel.maxCodeLength && decoder.tableBits == kernel.tableBits &&
+            streams == kernel.streams) {
+            return kernel.decode;
+        }
+    }
+    throw std::runtime_error("no decoder for " + std::to_string(streams) + " streams");
+}
+
+//Decodes a single stream payload (CODEC_HUFFMAN, and every version 1 and 2 file) of the file that starts at data,
+//which ends with the eof glyph (256), into the room output makes for it (see decodeBlocks). When the header
+//gives the original size, that many glyphs go through the fast path of a decoding kernel and only the eof glyph
+//is left for the slow path. Older files don't say how long they are, so every glyph has to be checked for eof
+//and gets output on its own. The checksum, if there is one, is verified before decoding starts.
+void decodeMessage(const char *data, const HufFileHeader &header, const Decoder &decoder,
+                   const std::function<char *(size_t)> &output) {
+    const char *payload = data + header.payloadOffset;
+    if ((header.flags & HUFF_FLAG_CHECKSUM) && crc32c(payload, header.payloadSize) != header.payloadChecksum) {
+        throw std::runtime_error("checksum mismatch, the file is corrupt");
+    }
+
+    // A tree that is just one leaf has no bits to read
+    if (decoder.nodes[0].glyph != NO_GLYPH) {
+        return;
+    }
+
+    BitReader reader((const unsigned char *) payload, header.payloadSize);
+    if (header.formatVersion >= 3) {
+        // Every glyph takes at least a bit, so a bigger size can only come from a damaged header
+        if (header.originalSize / 8 > header.payloadSize) {
+            throw std::runtime_error("header says there are more bytes than the payload can hold");
+        }
+        findDecodeKernel(decoder, 1)(&reader, decoder, output((size_t) header.originalSize),
+                                     (size_t) header.originalSize);
+        if (decodeSymbol(reader, decoder) != 256 || reader.overran()) {
+            throw std::runtime_error("compressed data doesn't end with the eof glyph");
+        }
+        return;
+    }
+
+    while (true) {
+        int glyph = decodeSymbol(reader, decoder);
+        if (reader.overran()) {
+            throw std::runtime_error("compressed data ended before the eof glyph");
+        }
+        if (glyph == 256) {
+            return;
+        }
+        *output(1) = (char) glyph;
+    }
+}
+
+//The same, into a string
+string decodeMessage(const string &data, const HufFileHeader &header, const Decoder &decoder) {
+    string message;
+    decodeMessage(data.data(), header, decoder, [&](size_t length) {
+        size_t start = message.size();
+        message.resize(start + length);
+        return &message[start];
+    });
+    return message;
+}
+
+// The sizes at the front of a block, once they've been checked against the data that's there
+struct BlockHeader {
+    uint32_t originalLength = 0;
+    uint32_t encodedLength = 0;     // without RUN_BLOCK_BIT or RAW_BLOCK_BIT
+    bool run = false;
+    bool raw = false;
+};
+
+//Reads the sizes at the front of the block starting at block[0]. available is how many bytes of compressed data
+//there are from block[0] on. Throws unless the block fits in them and could really decode to as many bytes as
+//it says, so nobody sets aside room for a damaged size.
+BlockHeader readBlockHeader(const char *block, size_t available, const BlockFormat &format) {
+    if (available < BLOCK_HEADER_SIZE) {
+        throw std::runtime_error("compressed data ends in the middle of a block header");
+    }
+    const unsigned char *bytes = (const unsigned char *) block;
+    BlockHeader header;
+    header.originalLength = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+    header.encodedLength = bytes[4] | (bytes[5] << 8) | (bytes[6] << 16) | ((uint32_t) bytes[7] << 24);
+    header.run = format.runBlocks && (header.encodedLength & RUN_BLOCK_BIT);
+    header.raw = format.rawBlocks && !header.run && (header.encodedLength & RAW_BLOCK_BIT);
+    if (header.run) {
+        header.encodedLength &= ~RUN_BLOCK_BIT;
+        if (header.encodedLength != 1 || header.originalLength > MAX_BLOCK_SIZE) {
+            throw std::runtime_error("bad run block");
+        }
+    } else if (header.raw) {
+        header.encodedLength &= ~RAW_BLOCK_BIT;
+        if (header.encodedLength != header.originalLength) {
+            throw std::runtime_error("bad raw block");
+        }
+    } else if (header.originalLength / 8 > header.encodedLength) {
+        throw std::runtime_error("block says it holds more bytes than it can");
+    }
+    if (header.encodedLength > available - BLOCK_HEADER_SIZE) {
+        throw std::runtime_error("compressed data ends in the middle of a block");
+    }
+    return header;
+}
+
+//Reads the table of a block in a file with HUFF_FLAG_BLOCK_TABLES, from the block starting at block[0] whose
+//sizes readBlockHeader has checked. Sets tableSize to the bytes it takes up. Empty when the block uses the
+//file's table.
+vector<HuffTableEntry> readBlockTable(const char *block, const BlockHeader &header, size_t &tableSize) {
+    const unsigned char *bytes = (const unsigned char *) block + BLOCK_HEADER_SIZE;
+    size_t numberOfTableEntries = header.encodedLength >= 2 ? bytes[0] | (bytes[1] << 8) : 0;
+    tableSize = 2 + 6 * numberOfTableEntries;
+    if (header.encodedLength < tableSize || numberOfTableEntries > MAX_TABLE_ENTRIES) {
+        throw std::runtime_error("bad huffman table in block");
+    }
+    vector<HuffTableEntry> blockTable(numberOfTableEntries);
+    const unsigned char *field = bytes + 2;
+    for (HuffTableEntry &entry : blockTable) {
+        entry.glyph = (int16_t) (field[0] | (field[1] << 8));
+        entry.leftPointer = (int16_t) (field[2] | (field[3] << 8));
+        entry.rightPointer = (int16_t) (field[4] | (field[5] << 8));
+        field += 6;
+    }
+    return blockTable;
+}
+
+//Decodes the block starting at block[0], whose sizes readBlockHeader has checked, into out, which has room for
+//header.originalLength bytes. fileDecoder is for the file's table, used unless the block brings its own, whose
+//decoder comes from cache. Returns the size of the block.
+size_t decodeBlock(const char *block, const BlockHeader &header, const Decoder &fileDecoder, TableCache &cache,
+                   const BlockFormat &format, char *out) {
+    uint32_t originalLength = header.originalLength;
+    uint32_t encodedLength = header.encodedLength;
+    const unsigned char *bytes = (const unsigned char *) block + BLOCK_HEADER_SIZE;
+    if (header.run) {
+        memset(out, bytes[0], originalLength);
+        return BLOCK_HEADER_SIZE + encodedLength;
+    }
+    if (header.raw) {
+        memcpy(out, bytes, originalLength);
+        return BLOCK_HEADER_SIZE + encodedLength;
+    }
+
+    const Decoder *decoder = &fileDecoder;
+    std::shared_ptr<const Decoder> blockDecoder;
+    size_t tableSize = 0;
+    if (format.blockTables) {
+        vector<HuffTableEntry> blockTable = readBlockTable(block, header, tableSize);
+        if (!blockTable.empty()) {
+            blockDecoder = cache.decoder(blockTable);
+            decoder = blockDecoder.get();
+        }
+    }
+    if (decoder->nodes.empty()) {
+        throw std::runtime_error("a block needs the file's huffman table, but the file has none");
+    }
+    if (decoder->nodes[0].glyph != NO_GLYPH && originalLength > 0) {
+        throw std::runtime_error("huffman table has a single glyph but there is data to decode");
+    }
+
+    // Find where each stream starts using the sizes in front of them
+    const int streams = format.streams;
+    size_t jumpTableSize = 4 * (streams - 1);
+    if (tableSize + jumpTableSize > encodedLength) {
+        throw std::runtime_error("compressed data ends in the middle of a block");
+    }
+    BitReader readers[INTERLEAVED_STREAMS];
+    size_t streamStart = tableSize + jumpTableSize;
+    for (int stream = 0; stream < streams; stream++) {
+        size_t streamSize = encodedLength - streamStart;
+        if (stream < streams - 1) {
+            const unsigned char *size = bytes + tableSize + 4 * stream;
+            streamSize = size[0] | (size[1] << 8) | (size[2] << 16) | ((uint32_t) size[3] << 24);
+            if (streamSize > encodedLength - streamStart) {
+                throw std::runtime_error("bad stream size in block");
+            }
+        }
+        readers[stream] = BitReader(bytes + streamStart, streamSize);
+        streamStart += streamSize;
+    }
+
+    findDecodeKernel(*decoder, streams)(readers, *decoder, out, originalLength);
+
+    for (int stream = 0; stream < streams; stream++) {
+        if (readers[stream].overran()) {
+            throw std::runtime_error("compressed block ended early");
+        }
+    }
+
+    return BLOCK_HEADER_SIZE + encodedLength;
+}
+
+//Decodes the block starting at block[0] and appends its bytes to message. available is how many bytes of
+//compressed data there are from block[0] on, and room the most bytes the block may decode to: a run block
+//can say it holds up to MAX_BLOCK_SIZE bytes in 9, so nothing is set aside for it until it's known to fit.
+//Returns the size of the block.
+size_t decodeBlock(const char *block, size_t available, const Decoder &fileDecoder, TableCache &cache,
+                   const BlockFormat &format, uint64_t room, string &message) {
+    BlockHeader header = readBlockHeader(block, available, format);
+    if (header.originalLength > room) {
+        throw std::runtime_error("a block decodes to more than there is room for, the file is corrupt");
+    }
+    size_t start = message.size();
+    message.resize(start + header.originalLength);
+    return decodeBlock(block, header, fileDecoder, cache, format, &message[start]);
+}
+
+//How the blocks of a file are laid out, from its header
+BlockFormat blockFormat(const HufFileHeader &header) {
+    BlockFormat format;
+    format.streams = header.codecMode == CODEC_INTERLEAVED ? INTERLEAVED_STREAMS : 1;
+    format.blockTables = (header.flags & HUFF_FLAG_BLOCK_TABLES) != 0;
+    format.runBlocks = (header.flags & HUFF_FLAG_RUN_BLOCKS) != 0;
+    format.rawBlocks = (header.flags & HUFF_FLAG_RAW_BLOCKS) != 0;
+    return format;
+}
+
+//Decodes a CODEC_BLOCKS or CODEC_INTERLEAVED payload, one block at a time, from the file that starts at data.
+//Each block is checksummed right before it is decoded, into the room output makes for it: given a block's
+//decoded size, output returns where those bytes go. Blocks with tables of their own get decoders from cache.
+void decodeBlocks(const char *data, const HufFileHeader &header, const Decoder &decoder, TableCache &cache,
+                  const std::function<char *(size_t)> &output) {
+    size_t position = header.payloadOffset;
+    size_t payloadEnd = header.payloadOffset + header.payloadSize;
+    BlockFormat format = blockFormat(header);
+
+    bool verify = (header.flags & HUFF_FLAG_CHECKSUM) != 0;
+    uint32_t crc = CRC32C_INITIAL;
+
+    while (position < payloadEnd) {
+        size_t blockStart = position;
+        BlockHeader blockHeader = readBlockHeader(data + position, payloadEnd - position, format);
+        position += decodeBlock(data + position, blockHeader, decoder, cache, format,
+                                output(blockHeader.originalLength));
+        if (verify) {
+            crc = crc32cUpdate(crc, data + blockStart, position - blockStart);
+        }
+    }
+
+    if (verify && ~crc != header.payloadChecksum) {
+        throw std::runtime_error("checksum mismatch, the file is corrupt");
+    }
+}
+
+//The same, into a string
+string decodeBlocks(const string &data, const HufFileHeader &header, const Decoder &decoder) {
+    string message;
+    message.reserve((size_t) std::min(header.originalSize, 8 * header.payloadSize));
+    decodeBlocks(data.data(), header, decoder, sharedTableCache(), [&](size_t length) {
+        if (length > header.originalSize - message.size()) {
+            throw std::runtime_error("the file decodes to more than its header says");
+        }
+        size_t start = message.size();
+        message.resize(start + length);
+        return &message[start];
+    });
+    return message;
+}
+
+//Decodes the payload of a file that has been loaded into memory, whatever its codec mode
+string decodePayload(const string &data, const HufFileHeader &header, const Decoder &decoder) {
+    if (header.originalSize > SIZE_MAX / 2) {
+        throw std::runtime_error("too big to decode in memory on this machine");
+    }
+    if (header.codecMode == CODEC_HUFFMAN) {
+        return decodeMessage(data, header, decoder);
+    }
+    return decodeBlocks(data, header, decoder);
+}
+
+//Reads count bytes from position in a file
+string readFileRange(ifstream &fin, uint64_t position, uint64_t count) {
+    string data((size_t) count, '\0');
+    fin.seekg((std::streamoff) position, ios::beg);
+    if (!fin.read(&data[0], (std::streamsize) count)) {
+        throw std::runtime_error("unexpected end of file");
+    }
+    return data;
+}
+
+//Returns length bytes of the original file starting at offset, reading and decoding only the blocks that
+//overlap that range. The range is clipped to the end of the original file. Files without a seek index
+//(anything written before CODEC_BLOCKS) are decoded from the start.
+string decodeRange(const string &fileName, uint64_t offset, uint64_t length) {
+    ifstream fin(fileName, ios::in | ios::binary);
+    if (!fin) {
+        throw std::runtime_error("could not open " + fileName);
+    }
+    fin.seekg(0, ios::end);
+    uint64_t fileSize = (uint64_t) fin.tellg();
+
+    HufFileHeader header = readHufFileHeader(readFileRange(fin, 0, std::min<uint64_t>(fileSize, MAX_HEADER_SIZE)), fileSize);
+    std::shared_ptr<const Decoder> cachedDecoder = sharedTableCache().decoder(header.huffTable);
+    const Decoder &decoder = *cachedDecoder;
+
+    if (!(header.flags & HUFF_FLAG_SEEK_INDEX)) {
+        string data = readFileRange(fin, 0, fileSize);
+        string message = decodePayload(data, header, decoder);
+        return offset < message.size() ? message.substr((size_t) offset, (size_t) length) : string();
+    }
+
+    uint64_t payloadEnd = header.payloadOffset + header.payloadSize;
+    string indexData = readFileRange(fin, payloadEnd, fileSize - payloadEnd);
+    SeekIndex index = readSeekIndex(indexData.data(), indexData.size());
+
+    string message;
+    if (offset >= header.originalSize || length == 0) {
+        return message;
+    }
+    length = std::min(length, header.originalSize - offset);
+
+    uint64_t firstBlock = offset / index.blockSize;
+    uint64_t lastBlock = (offset + length - 1) / index.blockSize;
+    if (lastBlock >= index.points.size()) {
+        throw std::runtime_error("seek index doesn't cover the whole file");
+    }
+
+    uint64_t start = index.points[firstBlock].offset;
+    uint64_t end = lastBlock + 1 < index.points.size() ? index.points[lastBlock + 1].offset : header.payloadSize;
+    if (start > end || end > header.payloadSize) {
+        throw std::runtime_error("bad seek index");
+    }
+    string blocks = readFileRange(fin, header.payloadOffset + start, end - start);
+
+    for (uint64_t block = firstBlock; block <= lastBlock; block++) {
+        size_t position = (size_t) (index.points[block].offset - start);
+        size_t blockEnd = block + 1 < index.points.size() ? (size_t) (index.points[block + 1].offset - start) : blocks.size();
+        if (position > blockEnd || blockEnd > blocks.size()) {
+            throw std::runtime_error("bad seek index");
+        }
+        if ((header.flags & HUFF_FLAG_CHECKSUM) &&
+            crc32c(blocks.data() + position, blockEnd - position) != index.points[block].checksum) {
+            throw std::runtime_error("checksum mismatch in block " + std::to_string(block) + ", the file is corrupt");
+        }
+        size_t blockStart = message.size();
+        while (position < blockEnd) {
+            position += decodeBlock(blocks.data() + position, blockEnd - position, decoder, sharedTableCache(),
+                                    blockFormat(header), index.blockSize - (message.size() - blockStart), message);
+        }
+    }
+
+    return message.substr((size_t) (offset - firstBlock * index.blockSize), (size_t) length);
+}
+
+//Decodes a file with a seek index from fin to fout one indexed block at a time, so no more than one block and
+//its output are held at once however big the file is. Throws when a block would take more than maxMemory.
+void decodeFileInBlocks(ifstream &fin, const HufFileHeader &header, const Decoder &decoder, ofstream &fout,
+                        uint64_t maxMemory) {
+    uint64_t payloadEnd = header.payloadOffset + header.payloadSize;
+    string indexData = readFileRange(fin, payloadEnd, header.fileSize - payloadEnd);
+    SeekIndex index = readSeekIndex(indexData.data(), indexData.size());
+    BlockFormat format = blockFormat(header);
+    bool verify = (header.flags & HUFF_FLAG_CHECKSUM) != 0;
+    uint32_t crc = CRC32C_INITIAL;
+    uint64_t written = 0;
+
+    string message;
+    for (size_t block = 0; block < index.points.size(); block++) {
+        uint64_t start = index.points[block].offset;
+        uint64_t end = block + 1 < index.points.size() ? index.points[block + 1].offset : header.payloadSize;
+        if (start > end || end > header.payloadSize) {
+            throw std::runtime_error("bad seek index");
+        }
+        if (end - start + index.blockSize > maxMemory) {
+            throw std::runtime_error("block " + std::to_string(block) + " takes " +
+                                     std::to_string((end - start + index.blockSize) >> 20) + " MB, more than the memory limit allows");
+        }
+        string blocks = readFileRange(fin, header.payloadOffset + start, end - start);
+        if (verify) {
+            crc = crc32cUpdate(crc, blocks.data(), blocks.size());
+        }
+        message.clear();
+        for (size_t position = 0; position < blocks.size();) {
+            position += decodeBlock(blocks.data() + position, blocks.size() - position, decoder, sharedTableCache(),
+                                    format, index.blockSize - message.size(), message);
+        }
+        fout.write(message.data(), message.size());
+        written += message.size();
+    }
+
+    if (verify && ~crc != header.payloadChecksum) {
+        throw std::runtime_error("checksum mismatch, the file is corrupt");
+    }
+    if (written != header.originalSize) {
+        throw std::runtime_error("decoded " + std::to_string(written) + " bytes, header says " +
+                                 std::to_string(header.originalSize));
+    }
+}
+
+#ifdef HUFF_HAVE_MAPPED_FILES
+// A file mapped into memory: an existing one to read, or a new one of a given size to write, so the decoder
+// reads its input and writes its output in place instead of copying them through streams. Unmapped and closed
+// when it goes away. An empty file isn't mapped at all, and data() is null.
+class MappedFile {
+public:
+    //Maps fileName to read
+    explicit MappedFile(const string &fileName) {
+#if defined(_WIN32)
+        file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER fileSize;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize)) {
+            close();
+            throw std::runtime_error("could not open " + fileName);
+        }
+        map(fileName, (uint64_t) fileSize.QuadPart, false);
+#else
+        descriptor = open(fileName.c_str(), O_RDONLY);
+        struct stat status;
+        if (descriptor < 0 || fstat(descriptor, &status) != 0) {
+            close();
+            throw std::runtime_error("could not open " + fileName);
+        }
+        map(fileName, (uint64_t) status.st_size, false);
+#endif
+    }
+
+    //Creates fileName, or empties it, and maps size bytes of it to write. The disk space is set aside first, so
+    //a full disk is an error here rather than a crash (SIGBUS, or an exception on Windows) partway through
+    //writing to the mapping.
+    MappedFile(const string &fileName, uint64_t size) {
+#if defined(_WIN32)
+        file = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG) size;
+        if (file == INVALID_HANDLE_VALUE || !SetFilePointerEx(file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+            close();
+            throw std::runtime_error("could not write " + fileName);
+        }
+#else
+        descriptor = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (descriptor < 0 || !reserve(size)) {
+            bool full = errno == ENOSPC;
+            close();
+            throw std::runtime_error("could not write " + fileName + (full ? ", the disk is full" : ""));
+        }
+#endif
+        map(fileName, size, true);
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    char *data() const {
+        return view;
+    }
+
+    uint64_t size() const {
+        return length;
+    }
+
+private:
+#if !defined(_WIN32)
+    //Makes the file size bytes long, with the blocks to hold them allocated where the system can do that
+    bool reserve(uint64_t size) {
+#if defined(__linux__)
+        if (size > 0) {
+            int error = posix_fallocate(descriptor, 0, (off_t) size);
+            errno = error;
+            return error == 0;
+        }
+#endif
+        return ftruncate(descriptor, (off_t) size) == 0;
+    }
+#endif
+
+    void map(const string &fileName, uint64_t size, bool writable) {
+        length = size;
+        if (size == 0) {
+            return;
+        }
+        if (size > SIZE_MAX) {
+            close();
+            throw std::runtime_error(fileName + " is too big to map on this machine");
+        }
+#if defined(_WIN32)
+        // Mapping more than the file holds makes it that big
+        mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, (DWORD) (size >> 32),
+                                     (DWORD) size, nullptr);
+        view = mapping != nullptr ? (char *) MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0)
+                                  : nullptr;
+        if (view == nullptr) {
+            close();
+            throw std::runtime_error("could not map " + fileName);
+        }
+#else
+        void *address = mmap(nullptr, (size_t) size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                             writable ? MAP_SHARED : MAP_PRIVATE, descriptor, 0);
+        if (address == MAP_FAILED) {
+            close();
+            throw std::runtime_error("could not map " + fileName);
+        }
+        view = (char *) address;
+#endif
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (view != nullptr) {
+            UnmapViewOfFile(view);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (view != nullptr) {
+            munmap(view, (size_t) length);
+        }
+        if (descriptor >= 0) {
+            ::close(descriptor);
+        }
+        descriptor = -1;
+#endif
+        view = nullptr;
+    }
+
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int descriptor = -1;
+#endif
+    char *view = nullptr;
+    uint64_t length = 0;
+};
+
+//Decodes the payload of a file with a seek index from data, the whole file, straight into out, which has room
+//for the original bytes. Indexed blocks are handed out to one worker per core, each decoding into its own
+//part of out and checksumming every piece of its block right after decoding it, while it's still in cache, to
+//check against the checksum in the index. The payload's own checksum is put together from the index's (see
+//payloadChecksum), so nothing is read twice.
+void decodeBlocksInParallel(const char *data, const HufFileHeader &header, const Decoder &decoder, char *out) {
+    uint64_t payloadEnd = header.payloadOffset + header.payloadSize;
+    SeekIndex index = readSeekIndex(data + payloadEnd, (size_t) (header.fileSize - payloadEnd));
+    if ((uint64_t) index.points.size() != (header.originalSize + index.blockSize - 1) / index.blockSize) {
+        throw std::runtime_error("seek index doesn't cover the whole file");
+    }
+    // The blocks have to cover the whole payload for their checksums to add up to its
+    if (!index.points.empty() && index.points[0].offset != 0) {
+        throw std::runtime_error("bad seek index");
+    }
+    BlockFormat format = blockFormat(header);
+    bool verify = (header.flags & HUFF_FLAG_CHECKSUM) != 0;
+    if (verify && payloadChecksum(index, header.payloadSize) != header.payloadChecksum) {
+        throw std::runtime_error("checksum mismatch, the file is corrupt");
+    }
+    const char *payload = data + header.payloadOffset;
+
+    std::atomic<size_t> nextBlock(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr failure;
+    std::mutex failureMutex;
+    size_t workerCount = std::min<size_t>(index.points.size(), (size_t) availableCores());
+    vector<std::thread> workers;
+    for (size_t i = 0; i < workerCount; i++) {
+        workers.push_back(std::thread([&] {
+            try {
+                for (size_t block = nextBlock++; block < index.points.size() && !failed; block = nextBlock++) {
+                    uint64_t start = index.points[block].offset;
+                    uint64_t end = block + 1 < index.points.size() ? index.points[block + 1].offset : header.payloadSize;
+                    if (start > end || end > header.payloadSize) {
+                        throw std::runtime_error("bad seek index");
+                    }
+                    uint64_t outStart = (uint64_t) block * index.blockSize;
+                    size_t room = (size_t) std::min<uint64_t>(index.blockSize, header.originalSize - outStart);
+                    char *blockOut = out + outStart;
+                    uint32_t crc = CRC32C_INITIAL;
+                    for (size_t position = (size_t) start; position < end;) {
+                        size_t pieceStart = position;
+                        BlockHeader blockHeader = readBlockHeader(payload + position, (size_t) (end - position), format);
+                        if (blockHeader.originalLength > room) {
+                            throw std::runtime_error("block " + std::to_string(block) + " decodes to more than it should");
+                        }
+                        position += decodeBlock(payload + position, blockHeader, decoder, sharedTableCache(), format,
+                                                blockOut);
+                        if (verify) {
+                            crc = crc32cUpdate(crc, payload + pieceStart, position - pieceStart);
+                        }
+                        blockOut += blockHeader.originalLength;
+                        room -= blockHeader.originalLength;
+                    }
+                    if (verify && ~crc != index.points[block].checksum) {
+                        throw std::runtime_error("checksum mismatch in block " + std::to_string(block) +
+                                                 ", the file is corrupt");
+                    }
+                    if (room > 0) {
+                        throw std::runtime_error("block " + std::to_string(block) + " decodes to less than it should");
+                    }
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(failureMutex);
+                if (!failed) {
+                    failure = std::current_exception();
+                    failed = true;
+                }
+            }
+        }));
+    }
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+//Restores a version 3 file by mapping it, and an output file sized from its header, into memory and decoding
+//from one into the other (see decodeBlocksInParallel). Files without a seek index are decoded one block after
+//another, but still in place. Returns false, having done nothing, for a file this doesn't handle: one that
+//predates version 3, or holds a single bitstream.
+bool decompressMappedFile(const string &fileName, string outputName) {
+    MappedFile input(fileName);
+    HufFileHeader header = readHufFileHeader(input.data(), (size_t) input.size(), input.size());
+    if (header.formatVersion < 3 || header.codecMode == CODEC_HUFFMAN) {
+        return false;
+    }
+    std::shared_ptr<const Decoder> decoder = sharedTableCache().decoder(header.huffTable);
+    if (outputName.empty()) {
+        outputName = header.fileName;
+    }
+
+    // A failed decode leaves no output the size of the original with garbage in it (see writeFileSafely)
+    writeFileSafely(fileName, outputName, [&](const string &partialName) {
+        MappedFile output(partialName, header.originalSize);
+        if (header.flags & HUFF_FLAG_SEEK_INDEX) {
+            decodeBlocksInParallel(input.data(), header, *decoder, output.data());
+            return;
+        }
+        uint64_t written = 0;
+        decodeBlocks(input.data(), header, *decoder, sharedTableCache(), [&](size_t count) {
+            if (count > header.originalSize - written) {
+                throw std::runtime_error("the file decodes to more than its header says");
+            }
+            written += count;
+            return output.data() + (written - count);
+        });
+        if (written != header.originalSize) {
+            throw std::runtime_error("decoded " + std::to_string(written) + " bytes, header says " +
+                                     std::to_string(header.originalSize));
+        }
+    });
+    return true;
+}
+#endif
+
+//Restores the original file from a .huf file. The output goes to outputName, or to the name stored in the
+//header when outputName is empty. With a maxMemory other than 0 (on top of BASE_MEMORY), a file with a seek
+//index is decoded a block at a time (see decodeFileInBlocks); any other file has to fit in it whole. Without
+//one, files are decoded in place where they can be mapped into memory (see decompressMappedFile).
+void decompressFile(const string &fileName, string outputName, uint64_t maxMemory) {
+    ifstream fin(fileName, ios::in | ios::binary);
+    if (!fin) {
+        throw std::runtime_error("could not open " + fileName);
+    }
+    if (maxMemory > 0) {
+        fin.seekg(0, ios::end);
+        uint64_t fileSize = (uint64_t) fin.tellg();
+        HufFileHeader header = readHufFileHeader(readFileRange(fin, 0, std::min<uint64_t>(fileSize, MAX_HEADER_SIZE)),
+                                                 fileSize);
+        if (header.flags & HUFF_FLAG_SEEK_INDEX) {
+            std::shared_ptr<const Decoder> decoder = sharedTableCache().decoder(header.huffTable);
+            string name = outputName.empty() ? header.fileName : outputName;
+            writeFileSafely(fileName, name, [&](const string &partialName) {
+                writeStream(partialName, [&](ofstream &fout) {
+                    decodeFileInBlocks(fin, header, *decoder, fout, maxMemory);
+                });
+            });
+            return;
+        }
+        if (fileSize + header.originalSize > maxMemory) {
+            throw std::runtime_error("this file has no seek index, so it has to be decoded whole, which takes " +
+                                     std::to_string((fileSize + header.originalSize) >> 20) + " MB");
+        }
+        fin.seekg(0, ios::beg);
+    }
+#ifdef HUFF_HAVE_MAPPED_FILES
+    else if (decompressMappedFile(fileName, outputName)) {
+        return;
+    }
+#endif
+    string data((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    fin.close();
+
+    HufFileHeader header = readHufFileHeader(data, data.size());
+    std::shared_ptr<const Decoder> decoder = sharedTableCache().decoder(header.huffTable);
+    string message = decodePayload(data, header, *decoder);
+    if (header.formatVersion >= 3 && message.size() != header.originalSize) {
+        throw std::runtime_error("decoded " + std::to_string(message.size()) + " bytes, header says " +
+                                 std::to_string(header.originalSize));
+    }
+
+    if (outputName.empty()) {
+        outputName = header.fileName;
+    }
+    writeFileSafely(fileName, outputName, [&](const string &partialName) {
+        writeStream(partialName, [&](ofstream &fout) {
+            fout.write(message.c_str(), message.size());
+        });
+    });
+}
+
+// Columns of the CSV that dumpTables writes: a row for every glyph of every table, with the Kraft sum of its
+// table repeated on each. Grouping the rows of a table by length gives its code length histogram.
+const char *const TABLE_DUMP_CSV_HEADER = "block,piece,kind,glyph,frequency,length,code,kraft";
+
+//A string as JSON writes it: quoted, with quotes, backslashes and control characters escaped
+string jsonString(const string &text) {
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char) c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof escaped, "\\u%04x", (unsigned char) c);
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+//Writes out one table: every glyph with how often it came up in counts, its code length and its code (bits in
+//the order they're written), then for JSON how many codes there are of each length, and the Kraft sum of the
+//lengths, which is 1 for a complete tree. As a JSON object, or as CSV rows that start with rowPrefix.
+void writeTable(std::ostream &out, vector<HuffTableEntry> huffTable, const vector<uint64_t> &counts, bool csv,
+                const string &rowPrefix) {
+    map<int, string> byteCodes = huffTable.empty() ? map<int, string>() : generateByteCodeTable(huffTable);
+    double kraft = 0;
+    vector<int> histogram;
+    for (auto entry : byteCodes) {
+        kraft += std::ldexp(1.0, -(int) entry.second.size());
+        histogram.resize(std::max(histogram.size(), entry.second.size() + 1));
+        histogram[entry.second.size()]++;
+    }
+
+    if (csv) {
+        for (auto entry : byteCodes) {
+            out << rowPrefix << entry.first << "," << (entry.first < 256 ? counts[entry.first] : 0) << ","
+                << entry.second.size() << "," << entry.second << "," << kraft << "\n";
+        }
+        return;
+    }
+    out << "{\"glyphs\": [";
+    const char *separator = "";
+    for (auto entry : byteCodes) {
+        out << separator << "{\"glyph\": " << entry.first << ", \"frequency\": "
+            << (entry.first < 256 ? counts[entry.first] : 0) << ", \"length\": " << entry.second.size()
+            << ", \"code\": \"" << entry.second << "\"}";
+        separator = ", ";
+    }
+    out << "], \"lengthHistogram\": [";
+    for (size_t length = 0; length < histogram.size(); length++) {
+        out << (length > 0 ? ", " : "") << histogram[length];
+    }
+    out << "], \"kraft\": " << kraft << "}";
+}
+
+//Dumps every huffman table in a .huf file, as JSON or CSV (see writeTable), for looking at offline. Each piece
+//of each block is listed with the kind of block it is and, unless it's a run or stored as it is, the table it
+//was coded with: its own, or the file's. Pieces are decoded to count how often each glyph comes up in them. The
+//file's table comes last, with how often each glyph comes up in the whole file.
+void dumpTables(const string &fileName, std::ostream &out, bool csv) {
+    ifstream fin(fileName, ios::in | ios::binary);
+    if (!fin) {
+        throw std::runtime_error("could not open " + fileName);
+    }
+    string data((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    HufFileHeader header = readHufFileHeader(data, data.size());
+    std::shared_ptr<const Decoder> fileDecoder = sharedTableCache().decoder(header.huffTable);
+    out << std::setprecision(17);
+    out << (csv ? string(TABLE_DUMP_CSV_HEADER) + "\n" : "{\"file\": " + jsonString(fileName) + ", \"blocks\": [");
+
+    vector<uint64_t> fileCounts(256);
+    if (header.codecMode == CODEC_HUFFMAN) {
+        string message = decodePayload(data, header, *fileDecoder);
+        countBytes(message.data(), message.size(), fileCounts);
+    } else {
+        SeekIndex index;
+        uint64_t payloadEnd = header.payloadOffset + header.payloadSize;
+        if (header.flags & HUFF_FLAG_SEEK_INDEX) {
+            index = readSeekIndex(data.data() + payloadEnd, data.size() - (size_t) payloadEnd);
+        }
+        BlockFormat format = blockFormat(header);
+
+        string piece;
+        size_t block = 0;
+        size_t pieceInBlock = 0;
+        uint64_t decoded = 0;
+        for (size_t position = header.payloadOffset; position < payloadEnd; pieceInBlock++) {
+            // Without a seek index every piece counts as a block of its own
+            uint64_t offset = position - header.payloadOffset;
+            if (index.points.empty() && position > header.payloadOffset) {
+                block++;
+                pieceInBlock = 0;
+            }
+            while (block + 1 < index.points.size() && index.points[block + 1].offset <= offset) {
+                block++;
+                pieceInBlock = 0;
+            }
+
+            BlockHeader blockHeader = readBlockHeader(data.data() + position, (size_t) (payloadEnd - position), format);
+            vector<HuffTableEntry> blockTable;
+            size_t tableSize = 0;
+            if (format.blockTables && !blockHeader.run && !blockHeader.raw) {
+                blockTable = readBlockTable(data.data() + position, blockHeader, tableSize);
+            }
+            if (blockHeader.originalLength > header.originalSize - decoded) {
+                throw std::runtime_error("the file decodes to more than its header says");
+            }
+            decoded += blockHeader.originalLength;
+            piece.resize(blockHeader.originalLength);
+            size_t blockStart = position;
+            position += decodeBlock(data.data() + position, blockHeader, *fileDecoder, sharedTableCache(), format,
+                                    &piece[0]);
+            vector<uint64_t> counts(256);
+            countBytes(piece.data(), piece.size(), counts);
+            for (int glyph = 0; glyph < 256; glyph++) {
+                fileCounts[glyph] += counts[glyph];
+            }
+
+            string kind = blockHeader.run ? "run" : blockHeader.raw ? "raw" : blockTable.empty() ? "file" : "own";
+            if (csv) {
+                if (!blockHeader.run && !blockHeader.raw) {
+                    writeTable(out, blockTable.empty() ? header.huffTable : blockTable, counts, true,
+                               std::to_string(block) + "," + std::to_string(pieceInBlock) + "," + kind + ",");
+                }
+                continue;
+            }
+            out << (blockStart > header.payloadOffset ? ",\n  " : "\n  ") << "{\"block\": " << block << ", \"piece\": "
+                << pieceInBlock << ", \"kind\": \"" << kind << "\", \"originalLength\": " << blockHeader.originalLength
+                << ", \"encodedLength\": " << blockHeader.encodedLength;
+            if (!blockHeader.run && !blockHeader.raw) {
+                out << ", \"table\": ";
+                writeTable(out, blockTable.empty() ? header.huffTable : blockTable, counts, false, "");
+            }
+            out << "}";
+        }
+    }
+
+    if (csv) {
+        writeTable(out, header.huffTable, fileCounts, true, "file,,file,");
+        return;
+    }
+    out << "],\n \"fileTable\": ";
+    writeTable(out, header.huffTable, fileCounts, false, "");
+    out << "}" << endl;
+}
+
+//Compresses the file fileInfo describes into a string, with whatever settings fileInfo holds
+string compressInMemory(FileInfo &fileInfo) {
+    std::ostringstream out;
+    fileInfo.fileStream.clear();
+    fileInfo.fileStream.seekg(0, ios::beg);
+    std::shared_ptr<const CachedTable> table = createHuffmanTable(fileInfo);
+    writeHufFile(out, fileInfo, *table, 0);
+    return out.str();
+}
+
+//Restores the original bytes of a .huf file that has been loaded into memory
+string decompressInMemory(const string &data) {
+    HufFileHeader header = readHufFileHeader(data, data.size());
+    Decoder decoder = buildDecoder(header.huffTable);
+    return decodePayload(data, header, decoder);
+}
+
+size_t compressBound(size_t length) {
+    // Any piece of a block can come out stored as it is, which costs a block header on top of its bytes. Blocks
+    // are never smaller than BLOCK_SIZE, and splitting never cuts them finer than the smallest split window.
+    size_t window = BLOCK_SIZE;
+    for (const CompressionLevel &settings : COMPRESSION_LEVELS) {
+        if (settings.splitWindow > 0) {
+            window = std::min(window, settings.splitWindow);
+        }
+    }
+    // A file that fits in one block has no seek index.
+    size_t blocks = length / BLOCK_SIZE + 1;
+    size_t pieces = blocks + length / window;
+    size_t header = (size_t) hufHeaderSize(0, MAX_TABLE_ENTRIES);
+    size_t seekIndex = length <= BLOCK_SIZE ? 0 : (size_t) hufSeekIndexSize(blocks);
+    return header + length + BLOCK_HEADER_SIZE * pieces + seekIndex;
+}
+
+//Throws unless level is one of the compression levels
+void checkCompressionLevel(int level) {
+    if (level < 1 || level > 9) {
+        throw std::runtime_error("compression level " + std::to_string(level) + " isn't between 1 and 9");
+    }
+}
+
+//Compresses length bytes at in into out with the settings in fileInfo, for compress() and HuffContext
+size_t compressSpan(FileInfo &fileInfo, const uint8_t *in, size_t length, uint8_t *out, size_t capacity) {
+    fileInfo.memory = (const char *) in;
+    fileInfo.fileStreamLength = length;
+
+    std::shared_ptr<const CachedTable> table = createHuffmanTable(fileInfo);
+    return writeHufSpan(fileInfo, *table, (char *) out, capacity);
+}
+
+//Restores the length bytes of compressed data at in into out, for decompress() and HuffContext. Decoders come
+//from cache, and the header is read into fileHeader, which keeps its memory for the next call.
+size_t decompressSpan(TableCache &cache, HufFileHeader &fileHeader, const uint8_t *in, size_t length, uint8_t *out,
+                      size_t capacity) {
+    const char *data = (const char *) in;
+    readHufFileHeader(data, length, length, fileHeader);
+    std::shared_ptr<const Decoder> decoder = cache.decoder(fileHeader.huffTable);
+    size_t written = 0;
+    auto output = [&](size_t count) {
+        if (count > capacity - written) {
+            throw std::runtime_error("the output buffer is too small, decompressedSize says how big it needs to be");
+        }
+        char *next = (char *) out + written;
+        written += count;
+        return next;
+    };
+
+    if (fileHeader.codecMode == CODEC_HUFFMAN) {
+        decodeMessage(data, fileHeader, *decoder, output);
+        return written;
+    }
+    decodeBlocks(data, fileHeader, *decoder, cache, output);
+    if (written != fileHeader.originalSize) {
+        throw std::runtime_error("decoded " + std::to_string(written) + " bytes, header says " +
+                                 std::to_string(fileHeader.originalSize));
+    }
+    return written;
+}
+
+size_t compress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity, int level) {
+    checkCompressionLevel(level);
+    FileInfo fileInfo;
+    fileInfo.fileNameLength = 0;
+    applyCompressionLevel(fileInfo, level);
+    fileInfo.tableCache = &sharedTableCache();
+    return compressSpan(fileInfo, in, length, out, capacity);
+}
+
+uint64_t decompressedSize(const uint8_t *in, size_t length) {
+    return readHufFileHeader((const char *) in, length, length).originalSize;
+}
+
+size_t decompress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity) {
+    HufFileHeader header;
+    return decompressSpan(sharedTableCache(), header, in, length, out, capacity);
+}
+
+// Everything a HuffContext keeps from one call to the next. The FileInfo holds the level's settings, and the
+// glyph counts that compressSpan leaves in it keep their memory for the next call. Tables are built in
+// tableScratch, over the last one the cache let go of, and headers are read into header. The context's tables
+// and decoders are its own, so looking them up never waits on another thread.
+struct HuffContext::Scratch {
+    FileInfo fileInfo;
+    TableCache tableCache;
+    TableScratch tableScratch;
+    HufFileHeader header;
+
+    Scratch() : tableCache(TABLE_CACHE_CAPACITY) {}
+};
+
+HuffContext::HuffContext(int level) : scratch(new Scratch) {
+    checkCompressionLevel(level);
+    scratch->fileInfo.fileNameLength = 0;
+    applyCompressionLevel(scratch->fileInfo, level);
+    scratch->fileInfo.tableCache = &scratch->tableCache;
+    scratch->fileInfo.tableScratch = &scratch->tableScratch;
+}
+
+HuffContext::~HuffContext() {}
+
+size_t HuffContext::compress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity) {
+    return compressSpan(scratch->fileInfo, in, length, out, capacity);
+}
+
+size_t HuffContext::decompress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity) {
+    return decompressSpan(scratch->tableCache, scratch->header, in, length, out, capacity);
+}
+
+double secondsSince(Stopwatch::time_point start) {
+    return std::chrono::duration<double>(Stopwatch::now() - start).count();
+}
+
+double megabytesPerSecond(double bytes, double seconds) {
+    return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0;
+}
+
+//length bytes drawn from the first alphabetSize glyphs, each skew times as likely as the next (1 for all
+//alike). Glyphs come in runs, meanRun long on average, so the data can look more like text than noise.
+string randomBytes(std::mt19937 &random, size_t length, int alphabetSize, double skew, int meanRun) {
+    vector<double> weights(alphabetSize);
+    for (int glyph = 0; glyph < alphabetSize; glyph++) {
+        weights[glyph] = std::pow(skew, -glyph);
+    }
+    std::discrete_distribution<int> pickGlyph(weights.begin(), weights.end());
+    std::geometric_distribution<int> pickRun(1.0 / meanRun);
+
+    string data;
+    data.reserve(length);
+    while (data.size() < length) {
+        size_t run = std::min<size_t>(1 + pickRun(random), length - data.size());
+        data.append(run, (char) pickGlyph(random));
+    }
+    return data;
+}
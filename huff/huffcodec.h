@@ -0,0 +1,286 @@
+//huffcodec.h
+//The .huf format and the codec behind huff.h, shared by the huff program and the codec's own code. Everything
+//declared here is defined in huffcodec.cpp.
+
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <chrono>
+#include <random>
+
+#include "huff.h"
+
+using std::map;
+using std::vector;
+using std::string;
+
+using std::ofstream;
+using std::ifstream;
+using std::ios;
+
+using std::cin;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+// Every .huf written by this program starts with these bytes followed by a one byte format version.
+// Version 1 files (the original layout) have no magic and start directly with the file name length.
+// Version 2 added the magic and 16-bit table fields, version 3 the flags, codec mode, sizes and checksum.
+const char HUFF_MAGIC[4] = {'H', 'U', 'F', 'F'};
+const unsigned char HUFF_FORMAT_VERSION = 3;
+
+// Header flags
+const unsigned char HUFF_FLAG_CHECKSUM = 0x01;   // payloadChecksum holds the CRC32C of the payload
+const unsigned char HUFF_FLAG_SEEK_INDEX = 0x02; // a seek index follows the payload, see writeSeekIndex
+const unsigned char HUFF_FLAG_BLOCK_TABLES = 0x04; // every block may bring its own huffman table, see encodeBlock
+const unsigned char HUFF_FLAG_RUN_BLOCKS = 0x08;   // blocks may be runs of one byte, see encodeRunBlock
+const unsigned char HUFF_FLAG_RAW_BLOCKS = 0x10;   // blocks may be stored as they are, see encodeRawBlock
+const unsigned char HUFF_FLAG_NO_TABLE = 0x20;     // no file table: every block is a run, raw or has its own
+
+// Codec modes; tells the decoder how the payload after the table is laid out
+const unsigned char CODEC_HUFFMAN = 0;           // one bitstream ending with the eof glyph
+const unsigned char CODEC_BLOCKS = 1;            // independently decodable blocks, see encodeBlock
+const unsigned char CODEC_INTERLEAVED = 2;       // blocks split into INTERLEAVED_STREAMS bitstreams each
+
+// The encoder and decoder checksum the payload in pieces of this size as they produce or consume it, so each
+// piece is hashed while it is still in cache
+const size_t CHECKSUM_CHUNK_SIZE = 4096;
+const uint32_t CRC32C_INITIAL = 0xFFFFFFFF;
+
+// Size of each of the two output buffers the BufferedWriter alternates between, and of the reads the
+// encoder makes from the input file
+const size_t OUTPUT_BUFFER_SIZE = 1 << 16;
+const size_t INPUT_CHUNK_SIZE = 1 << 16;
+
+// With a sample stride of n, getGlyphFrequencies counts one piece of this many bytes out of every n. Inputs
+// smaller than MIN_SAMPLED_INPUT are always counted in full: reading them is cheap, and the smoothing that
+// gives every byte value a code would cost them more than the table saves.
+const size_t SAMPLE_PIECE_SIZE = 4096;
+const uint64_t MIN_SAMPLED_INPUT = 1 << 20;
+
+// Default bytes of input per block in CODEC_BLOCKS files (also the spacing of the seek points), and the size
+// of the header in front of each block
+const size_t BLOCK_SIZE = 1 << 17;
+const size_t BLOCK_HEADER_SIZE = 8;
+
+// Blocks keep their sizes in 32 bits. Up to this many bytes of input, even a block of 56-bit codes fits.
+const size_t MAX_BLOCK_SIZE = 1 << 26;
+
+// What huff takes before it holds any blocks (code and libraries, thread stacks, tables and caches), which
+// --max-memory has to leave room for, and the smallest blocks the encoder goes down to to fit under it
+const uint64_t BASE_MEMORY = 8 << 20;
+const size_t MIN_MEMORY_BLOCK_SIZE = 1 << 14;
+
+// Set in the encoded size of a block that is a run of one byte, or that is stored as it is (no encoded block
+// comes near 1GB)
+const uint32_t RUN_BLOCK_BIT = 0x80000000;
+const uint32_t RAW_BLOCK_BIT = 0x40000000;
+
+// Number of bitstreams each CODEC_INTERLEAVED block is split into. The decoder works on all of them at once,
+// so four lookups are independent of each other instead of each waiting on the last one's bit position.
+const int INTERLEAVED_STREAMS = 4;
+
+// The decoder's lookup table is indexed by this many bits; longer codes finish in the tree. Tables whose codes
+// are all SMALL_DECODE_TABLE_BITS or shorter get a lookup table of that width instead.
+const int DECODE_TABLE_BITS = 11;
+const int SMALL_DECODE_TABLE_BITS = 8;
+
+// Stands for "no limit" where the codec kernels are specialized on the longest code they handle
+const int ANY_CODE_LENGTH = 1 << 16;
+
+// How many tables (and as many decoders) the TableCache keeps, and how much worse than the table it was built
+// for a cached table may do on new counts before a fresh one is built instead (0.005 = half a percent)
+const size_t TABLE_CACHE_CAPACITY = 64;
+const double TABLE_CACHE_MAX_PENALTY = 0.005;
+
+// Settings behind the -1 .. -9 compression levels. Levels 1-3 go for speed: big blocks, one table for the whole
+// file and, at 1 and 2, codes no longer than the decoder's lookup table built from a sample of the input (level 1
+// also skips the checksum).
+// Levels 4-9 let each block bring its own table when that is cheaper than using the file's, and from level 5 on
+// blocks are split further where the data changes (see splitBlock), looking at smaller windows at each step.
+struct CompressionLevel {
+    size_t blockSize;
+    int streams;
+    bool blockTables;
+    int maxCodeLength;       // 0 for no limit
+    bool checksum;
+    size_t splitWindow;      // 0 for no splitting
+    int sampleStride;        // 1 to count every byte
+};
+
+const CompressionLevel COMPRESSION_LEVELS[9] = {
+    {1 << 20, INTERLEAVED_STREAMS, false, DECODE_TABLE_BITS, false, 0, 16},
+    {1 << 20, INTERLEAVED_STREAMS, false, DECODE_TABLE_BITS, true, 0, 4},
+    {1 << 18, INTERLEAVED_STREAMS, false, 0, true, 0, 1},
+    {1 << 18, INTERLEAVED_STREAMS, true, 0, true, 0, 1},
+    {1 << 17, INTERLEAVED_STREAMS, true, 0, true, 1 << 15, 1},
+    {1 << 17, INTERLEAVED_STREAMS, true, 0, true, 1 << 14, 1},
+    {1 << 17, INTERLEAVED_STREAMS, true, 0, true, 1 << 13, 1},
+    {1 << 17, INTERLEAVED_STREAMS, true, 0, true, 1 << 12, 1},
+    {1 << 17, INTERLEAVED_STREAMS, true, 0, true, 1 << 11, 1},
+};
+
+// Most entries a huffman table can have: a leaf for each of the 257 glyphs and the nodes joining them
+const int MAX_TABLE_ENTRIES = 2 * 257 - 1;
+
+// No .huf header can be longer than this: fixed fields, a 16-bit name length and MAX_TABLE_ENTRIES entries
+const size_t MAX_HEADER_SIZE = 1 << 17;
+
+// Longest code the BitWriter takes in one piece; with less than 8 bits pending it still fits in 64 bits
+const int MAX_PACKED_CODE_LENGTH = 56;
+
+// Marks a DecodeNode that is not a leaf
+const uint16_t NO_GLYPH = 0xFFFF;
+
+struct HuffTableEntry {
+    int glyph = -1;
+    uint64_t frequency = 0;
+    int leftPointer = -1;
+    int rightPointer = -1;
+};
+
+// Node of the tree the decoder walks. Children of an internal node sit next to each other, so following
+// bit b from node n is nodes[nodes[n].firstChild + b]. At 4 bytes a node the whole tree (at most 513
+// nodes) fits in about 2KB.
+struct DecodeNode {
+    uint16_t firstChild = 0;
+    uint16_t glyph = NO_GLYPH;
+};
+
+// Entry of the decoder's lookup table, indexed by the next tableBits bits of a stream. Codes that
+// short give their glyph and length straight away; longer ones give the tree node those bits lead to.
+struct DecodeTableEntry {
+    uint16_t glyph = NO_GLYPH;
+    uint16_t node = 0;
+    uint8_t length = 0;
+};
+
+// Entry of the decoder's pair table, indexed like the lookup table. When the next tableBits bits start with two
+// whole codes it gives both glyphs (count 2), otherwise just the first (count 1), and the bits they take up.
+// count is 0 when the first code is the eof glyph or longer than the table; the lookup table handles those.
+struct DecodePair {
+    uint8_t glyphs[2] = {0, 0};
+    uint8_t count = 0;
+    uint8_t length = 0;
+};
+
+// Everything needed to decode with one huffman table
+struct Decoder {
+    vector<DecodeNode> nodes;
+    vector<DecodeTableEntry> table;
+    vector<DecodePair> pairs;
+    int maxCodeLength = 0;
+    int tableBits = DECODE_TABLE_BITS;
+};
+
+// Everything read out of a .huf header
+struct HufFileHeader {
+    int formatVersion;
+    unsigned char flags = 0;
+    unsigned char codecMode = CODEC_HUFFMAN;
+    uint64_t originalSize = 0;
+    uint64_t payloadSize = 0;
+    uint32_t payloadChecksum = 0;
+    uint64_t fileSize = 0;
+    string fileName;
+    vector<HuffTableEntry> huffTable;
+    size_t payloadOffset;
+};
+
+// What compressing a file found out along the way, for reporting
+struct CompressionStats {
+    uint64_t sampledBytes = 0;
+    vector<uint64_t> byteCounts;    // exact counts, gathered while encoding when the table came from a sample
+    double samplingLoss = 0;        // how much bigger the codes came out than with an exact table, 0.01 = 1%
+    uint64_t compressedSize = 0;    // the whole .huf file
+    uint64_t peakMemory = 0;        // most memory the process has held at once, up to the end of this file
+};
+
+class TableCache;
+struct TableScratch;
+
+struct FileInfo {
+    string fileName;
+    int fileNameLength;
+    const char *memory = nullptr;       // the input, when it's already in memory instead of in fileName
+    ifstream fileStream;
+    uint64_t fileStreamLength = 0;
+    int numberOfGlyphsInFile;
+    bool checksum = true;
+    size_t blockSize = BLOCK_SIZE;
+    int streams = 1;
+    bool blockTables = false;
+    int maxCodeLength = 0;
+    size_t splitWindow = 0;
+    int sampleStride = 1;
+    int workers = 0;                    // encoder threads; 0 for one per core, less one for the writer
+    bool pinWorkers = false;            // keep every encoder thread on a core of its own, when the cores fit exactly
+    int blocksInFlight = 0;             // most blocks between being handed out and written; 0 for a few per worker
+    uint64_t maxMemory = 0;             // most memory for blocks and buffers, on top of BASE_MEMORY; 0 for no limit
+    TableCache *tableCache = nullptr;   // where to look for tables built for similar data; null to always build
+    TableScratch *tableScratch = nullptr; // memory to build tables in on the calling thread; null to allocate it
+    CompressionStats stats;
+    vector<uint64_t> glyphCounts;       // what the table was built from, kept so the next file can count into it
+};
+
+// How the blocks of a CODEC_BLOCKS or CODEC_INTERLEAVED payload are laid out
+struct BlockFormat {
+    int streams = 1;
+    bool blockTables = false;
+    bool runBlocks = false;
+    bool rawBlocks = false;
+};
+
+// Where a block starts, counted from the start of the payload, and the CRC32C of the whole block. Each is
+// SEEK_POINT_SIZE bytes in the file.
+const size_t SEEK_POINT_SIZE = 8 + 4;
+struct SeekPoint {
+    uint64_t offset = 0;
+    uint32_t checksum = 0;
+};
+
+// The seek index at the end of a CODEC_BLOCKS file: block k holds original bytes [k * blockSize, (k + 1) * blockSize)
+struct SeekIndex {
+    uint32_t blockSize = 0;
+    vector<SeekPoint> points;
+};
+
+// Counting input and choosing settings
+void loadFileContents(FileInfo &fileInfo);
+bool samplesInput(const FileInfo &fileInfo);
+void applyCompressionLevel(FileInfo &fileInfo, int level);
+void checkCompressionLevel(int level);
+void fitToMemory(FileInfo &fileInfo);
+uint64_t peakResidentMemory();
+uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t length);
+uint32_t crc32c(const void *data, size_t length);
+TableCache &sharedTableCache();
+
+// Files on disk
+void compressFile(FileInfo &fileInfo);
+int compressFiles(const vector<string> &fileNames, const std::function<void(FileInfo &)> &setUp);
+int analyzeFiles(const vector<string> &fileNames, const std::function<void(FileInfo &)> &setUp);
+void decompressFile(const string &fileName, string outputName, uint64_t maxMemory = 0);
+string decodeRange(const string &fileName, uint64_t offset, uint64_t length);
+void dumpTables(const string &fileName, std::ostream &out, bool csv);
+
+// .huf data in memory
+HufFileHeader readHufFileHeader(const char *data, size_t length, uint64_t fileSize);
+void readHufFileHeader(const char *data, size_t length, uint64_t fileSize, HufFileHeader &header);
+HufFileHeader readHufFileHeader(const string &data, uint64_t fileSize);
+string compressInMemory(FileInfo &fileInfo);
+string decompressInMemory(const string &data);
+
+// Timing and made up inputs, for the benchmarks and the self test
+// The pipeline runs on several threads, so timings use the wall clock rather than clock()'s processor time
+typedef std::chrono::steady_clock Stopwatch;
+
+double secondsSince(Stopwatch::time_point start);
+double megabytesPerSecond(double bytes, double seconds);
+string randomBytes(std::mt19937 &random, size_t length, int alphabetSize, double skew, int meanRun);
@@ -0,0 +1,718 @@
+//selftest.cpp
+//The self test for huff, run by ctest: round trips made up inputs at every level, holds the decoder to a plain
+//walk of the huffman tree, decodes the files the first version of huff wrote, and, given a baseline file,
+//checks that compression and decompression haven't got slower compared with a plain loop over the same input.
+//On request it also round trips a file of over 4 GiB.
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iomanip>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <cstdlib>
+#include <cmath>
+#include <random>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+
+#include "huffcodec.h"
+
+// Where the self test keeps the inputs and outputs it round trips, in the current directory
+const char *const SELF_TEST_INPUT = "huff-selftest.tmp";
+const char *const SELF_TEST_OUTPUT = "huff-selftest.huf";
+const char *const SELF_TEST_RESTORED = "huff-selftest.out";
+
+// The large file test: a file just over 4 GiB, so sizes, offsets and block numbers all have to get past 32 bits.
+// It's sparse apart from stretches of text at the start, across 2 GiB and 4 GiB, and at the end, so it takes
+// little disk to make, though the restored copy is written out in full. compressFile names its output after it.
+const char *const LARGE_TEST_INPUT = "huff-large.tmp";
+const char *const LARGE_TEST_OUTPUT = "huff-large.huf";
+const char *const LARGE_TEST_RESTORED = "huff-large.out";
+const uint64_t LARGE_TEST_SIZE = ((uint64_t) 4 << 30) + (1 << 20) + 4097;
+const size_t LARGE_TEST_STRETCH = 1 << 16;
+
+// How many made up inputs the self test adds to its fixed ones, and how many damaged copies of every output
+// it tries to decode
+const int SELF_TEST_RANDOM_INPUTS = 48;
+const int SELF_TEST_CORRUPTIONS = 4;
+
+// Every level writes INTERLEAVED_STREAMS streams to a block. These levels run again with a single stream, for
+// the CODEC_BLOCKS format and the decoding loops made for it.
+const int SELF_TEST_ONE_STREAM_LEVELS[] = {1, 3, 9};
+
+// The .huf files in the test directory, written by the first version of huff, and the files they came from. The
+// text files were compressed from copies with Windows line ends.
+struct SelfTestFixture {
+    const char *compressed;
+    const char *original;
+    bool text;
+};
+
+const SelfTestFixture SELF_TEST_FIXTURES[] = {
+    {"letters.huf", "LETTERS.TXT", true},
+    {"links.huf", "links.cpp", true},
+    {"ptw32.huf", "ptw32.hlp", false},
+};
+
+// The levels the performance gate times, and how much slower than the baseline they may get before it fails.
+// Speeds are kept as multiples of referenceSpeed, so one baseline holds on machines of any speed.
+const int PERF_GATE_LEVELS[] = {1, 5, 9};
+const double PERF_GATE_TOLERANCE = 0.25;
+const int PERF_GATE_RUNS = 9;
+
+// An input for the self test
+struct SelfTestCase {
+    string name;
+    string data;
+};
+
+//The inputs every self test runs: the corner cases first, then inputs of random length and makeup
+vector<SelfTestCase> selfTestCases(std::mt19937 &random) {
+    vector<SelfTestCase> cases;
+    cases.push_back({"empty", ""});
+    cases.push_back({"one byte", "x"});
+    cases.push_back({"one glyph", string(100000, 'a')});
+    cases.push_back({"two glyphs", randomBytes(random, 50000, 2, 1, 1)});
+
+    string everyGlyph;
+    for (int glyph = 0; glyph < 256; glyph++) {
+        everyGlyph += (char) glyph;
+    }
+    cases.push_back({"every glyph once", everyGlyph});
+
+    // Glyph k turns up as often as the k-th Fibonacci number, which makes the tree as deep as it can get for
+    // its size: 30 levels, past the longest codes the specialized loops handle
+    string fibonacci;
+    uint64_t previous = 1, count = 1;
+    for (int glyph = 0; glyph < 30; glyph++) {
+        fibonacci.append((size_t) count, (char) glyph);
+        uint64_t next = previous + count;
+        previous = count;
+        count = next;
+    }
+    std::shuffle(fibonacci.begin(), fibonacci.end(), random);
+    cases.push_back({"fibonacci", fibonacci});
+
+    cases.push_back({"block edges", randomBytes(random, 3 * BLOCK_SIZE + 17, 256, 1.03, 1)});
+    cases.push_back({"text then noise", randomBytes(random, 200000, 64, 1.1, 3) +
+                                        randomBytes(random, 200000, 256, 1, 1) + string(50000, ' ')});
+
+    // Big enough to be sampled, with one glyph that the sample is likely to miss
+    string sampled = randomBytes(random, MIN_SAMPLED_INPUT + MIN_SAMPLED_INPUT / 2, 64, 1.1, 4);
+    sampled[sampled.size() / 3] = (char) 255;
+    cases.push_back({"sampled", sampled});
+
+    // Sampled and several blocks long: one glyph alone is written from its counts, and one other byte that the
+    // sample misses has to stop that
+    string sampledRun(3 * MIN_SAMPLED_INPUT + 5, 'z');
+    cases.push_back({"sampled one glyph", sampledRun});
+    sampledRun[2 * MIN_SAMPLED_INPUT + SAMPLE_PIECE_SIZE + 1] = 'y';
+    cases.push_back({"sampled one glyph but one", sampledRun});
+
+    std::uniform_real_distribution<double> logLength(0, std::log(300000.0));
+    std::uniform_int_distribution<int> alphabetSize(1, 256);
+    std::uniform_real_distribution<double> skew(1, 1.5);
+    std::uniform_int_distribution<int> meanRun(1, 16);
+    for (int i = 0; i < SELF_TEST_RANDOM_INPUTS; i++) {
+        size_t length = (size_t) std::exp(logLength(random)) - 1;
+        cases.push_back({"random " + std::to_string(i + 1),
+                         randomBytes(random, length, alphabetSize(random), skew(random), meanRun(random))});
+    }
+    return cases;
+}
+
+//Writes data to a file, replacing whatever was there
+void writeWholeFile(const string &fileName, const string &data) {
+    ofstream fout(fileName, ios::out | ios::binary | ios::trunc);
+    fout.write(data.data(), data.size());
+    if (!fout) {
+        throw std::runtime_error("could not write " + fileName);
+    }
+}
+
+//Reads a whole file into a string
+string readWholeFile(const string &fileName) {
+    ifstream fin(fileName, ios::in | ios::binary);
+    if (!fin) {
+        throw std::runtime_error("could not open " + fileName);
+    }
+    return string((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+}
+
+// Reads a bitstream one bit at a time, least significant bit of each byte first, for treeWalkDecode
+struct TreeWalkBits {
+    const unsigned char *data;
+    size_t size;
+    size_t position;
+
+    int next() {
+        if (position >= 8 * size) {
+            throw std::runtime_error("a stream ends in the middle of a code");
+        }
+        int bit = (data[position >> 3] >> (position & 7)) & 1;
+        position++;
+        return bit;
+    }
+};
+
+//Follows bits from the root of huffTable (its first entry), left on 0 and right on 1, down to a leaf, and
+//returns the leaf's glyph
+int walkTree(const vector<HuffTableEntry> &huffTable, TreeWalkBits &bits) {
+    if (huffTable.empty()) {
+        throw std::runtime_error("no huffman table to walk");
+    }
+    size_t node = 0;
+    for (size_t depth = 0; huffTable[node].leftPointer != -1 || huffTable[node].rightPointer != -1; depth++) {
+        int child = bits.next() ? huffTable[node].rightPointer : huffTable[node].leftPointer;
+        if (child < 0 || child >= (int) huffTable.size() || depth >= huffTable.size()) {
+            throw std::runtime_error("bad pointer in huffman table");
+        }
+        node = (size_t) child;
+    }
+    return huffTable[node].glyph;
+}
+
+uint32_t treeWalkUint32(const unsigned char *bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+//Decodes a whole .huf file the slow and obvious way: every glyph is found by walking the huffman table from its
+//root a bit at a time, with none of the decoder's lookup tables or specialized loops. The self test holds the
+//decoder to what this gives. It's only given files huff wrote, so damage is checked just enough not to crash.
+string treeWalkDecode(const string &file) {
+    HufFileHeader header = readHufFileHeader(file, file.size());
+    const unsigned char *payload = (const unsigned char *) file.data() + header.payloadOffset;
+    size_t payloadSize = (size_t) header.payloadSize;
+    string message;
+
+    if (header.codecMode == CODEC_HUFFMAN) {
+        TreeWalkBits bits = {payload, payloadSize, 0};
+        for (int glyph = walkTree(header.huffTable, bits); glyph != 256; glyph = walkTree(header.huffTable, bits)) {
+            message += (char) glyph;
+        }
+        return message;
+    }
+
+    int streams = header.codecMode == CODEC_INTERLEAVED ? INTERLEAVED_STREAMS : 1;
+    size_t jumpTableSize = 4 * (streams - 1);
+    for (size_t position = 0; position < payloadSize;) {
+        if (payloadSize - position < BLOCK_HEADER_SIZE) {
+            throw std::runtime_error("compressed data ends in the middle of a block header");
+        }
+        const unsigned char *bytes = payload + position + BLOCK_HEADER_SIZE;
+        uint32_t originalLength = treeWalkUint32(bytes - BLOCK_HEADER_SIZE);
+        uint32_t encodedLength = treeWalkUint32(bytes - 4);
+        size_t available = payloadSize - position - BLOCK_HEADER_SIZE;
+        if ((header.flags & HUFF_FLAG_RUN_BLOCKS) && (encodedLength & RUN_BLOCK_BIT)) {
+            encodedLength &= ~RUN_BLOCK_BIT;
+            if (encodedLength != 1 || available < 1 || originalLength > MAX_BLOCK_SIZE) {
+                throw std::runtime_error("bad run block");
+            }
+            message.append(originalLength, (char) bytes[0]);
+        } else if ((header.flags & HUFF_FLAG_RAW_BLOCKS) && (encodedLength & RAW_BLOCK_BIT)) {
+            encodedLength &= ~RAW_BLOCK_BIT;
+            if (encodedLength != originalLength || available < encodedLength) {
+                throw std::runtime_error("bad raw block");
+            }
+            message.append((const char *) bytes, originalLength);
+        } else {
+            if (encodedLength > available) {
+                throw std::runtime_error("compressed data ends in the middle of a block");
+            }
+            const vector<HuffTableEntry> *table = &header.huffTable;
+            vector<HuffTableEntry> blockTable;
+            size_t tableSize = 0;
+            if (header.flags & HUFF_FLAG_BLOCK_TABLES) {
+                blockTable.resize(encodedLength >= 2 ? bytes[0] | (bytes[1] << 8) : 0);
+                tableSize = 2 + 6 * blockTable.size();
+                if (tableSize > encodedLength) {
+                    throw std::runtime_error("bad huffman table in block");
+                }
+                for (size_t i = 0; i < blockTable.size(); i++) {
+                    const unsigned char *field = bytes + 2 + 6 * i;
+                    blockTable[i].glyph = (int16_t) (field[0] | (field[1] << 8));
+                    blockTable[i].leftPointer = (int16_t) (field[2] | (field[3] << 8));
+                    blockTable[i].rightPointer = (int16_t) (field[4] | (field[5] << 8));
+                }
+                if (!blockTable.empty()) {
+                    table = &blockTable;
+                }
+            }
+            if (tableSize + jumpTableSize > encodedLength) {
+                throw std::runtime_error("compressed data ends in the middle of a block");
+            }
+
+            // Stream k holds the k-th of streams equal segments of the block (the last one may be shorter),
+            // and all but the last say how long they are in the jump table in front of them
+            size_t segment = (originalLength + streams - 1) / streams;
+            size_t streamStart = tableSize + jumpTableSize;
+            for (int stream = 0; stream < streams; stream++) {
+                size_t streamSize = encodedLength - streamStart;
+                if (stream < streams - 1) {
+                    streamSize = treeWalkUint32(bytes + tableSize + 4 * stream);
+                    if (streamSize > encodedLength - streamStart) {
+                        throw std::runtime_error("bad stream size in block");
+                    }
+                }
+                TreeWalkBits bits = {bytes + streamStart, streamSize, 0};
+                size_t count = std::min<size_t>(segment, originalLength - std::min<size_t>(originalLength, segment * stream));
+                for (size_t i = 0; i < count; i++) {
+                    message += (char) walkTree(*table, bits);
+                }
+                streamStart += streamSize;
+            }
+        }
+        position += BLOCK_HEADER_SIZE + encodedLength;
+    }
+    return message;
+}
+
+//Decodes the fixtures in directory, with decompressFile, with treeWalkDecode and with decompress() into a
+//buffer, and compares them with the files they came from. Prints what went wrong and returns how many things did.
+int checkFixtures(const string &directory) {
+    int failures = 0;
+    for (const SelfTestFixture &fixture : SELF_TEST_FIXTURES) {
+        string compressedName = directory + "/" + fixture.compressed;
+        try {
+            string original = readWholeFile(directory + "/" + fixture.original);
+            decompressFile(compressedName, SELF_TEST_RESTORED);
+            string compressed = readWholeFile(compressedName);
+            string decoded[3] = {readWholeFile(SELF_TEST_RESTORED), treeWalkDecode(compressed), ""};
+            // Version 1 headers don't give the original size, so the buffer is as big as the file decoded to
+            decoded[2].resize(decoded[0].size());
+            decoded[2].resize(decompress((const uint8_t *) compressed.data(), compressed.size(),
+                                         (uint8_t *) &decoded[2][0], decoded[2].size()));
+            for (string &restored : decoded) {
+                if (fixture.text) {
+                    restored.erase(std::remove(restored.begin(), restored.end(), '\r'), restored.end());
+                }
+            }
+            if (decoded[0] != original) {
+                throw std::runtime_error("decompresses to something else than " + string(fixture.original));
+            }
+            if (decoded[1] != original) {
+                throw std::runtime_error("walking the tree decodes something else than " + string(fixture.original));
+            }
+            if (decoded[2] != original) {
+                throw std::runtime_error("decompress() decodes something else than " + string(fixture.original));
+            }
+        } catch (const std::exception &e) {
+            cout << "  " << compressedName << ": " << e.what() << endl;
+            failures++;
+        }
+    }
+    size_t fixtures = sizeof SELF_TEST_FIXTURES / sizeof SELF_TEST_FIXTURES[0];
+    cout << fixtures << " version 1 files from " << directory << ": "
+         << (failures == 0 ? "all decoded" : std::to_string(failures) + " failures") << endl;
+    return failures;
+}
+
+//Round trips one input through every level, then SELF_TEST_ONE_STREAM_LEVELS with one stream, and with
+//randomSettings at a random block size and sample stride too. Each output is also decoded by treeWalkDecode,
+//decompressed as a file, and read back in pieces through the seek index, which all have to agree with the
+//input, and damaged copies of it have to be turned away with a runtime_error or decode to something, never
+//crash. The input also goes through compress() and decompress() in a buffer of compressBound() bytes, and
+//through compress() again into one of just the size that took.
+//Prints what went wrong and returns how many things did.
+int selfTestCase(const SelfTestCase &test, std::mt19937 &random, bool randomSettings) {
+    writeWholeFile(SELF_TEST_INPUT, test.data);
+    FileInfo fileInfo;
+    fileInfo.fileName = SELF_TEST_INPUT;
+    fileInfo.fileNameLength = fileInfo.fileName.length();
+    loadFileContents(fileInfo);
+
+    int failures = 0;
+    size_t runs = 9 + sizeof SELF_TEST_ONE_STREAM_LEVELS / sizeof SELF_TEST_ONE_STREAM_LEVELS[0];
+    for (size_t run = 0; run < runs; run++) {
+        bool oneStream = run >= 9;
+        int level = oneStream ? SELF_TEST_ONE_STREAM_LEVELS[run - 9] : (int) run + 1;
+        applyCompressionLevel(fileInfo, level);
+        if (oneStream) {
+            fileInfo.streams = 1;
+        }
+        fileInfo.tableCache = level % 2 == 0 ? &sharedTableCache() : nullptr;
+        if (randomSettings) {
+            fileInfo.blockSize = 1024 * std::uniform_int_distribution<size_t>(1, 256)(random);
+            fileInfo.sampleStride = std::uniform_int_distribution<int>(1, 32)(random);
+        }
+        string where = test.name + " (" + std::to_string(test.data.size()) + " bytes), level " + std::to_string(level) +
+                       (oneStream ? ", one stream" : "");
+
+        string data;
+        try {
+            data = compressInMemory(fileInfo);
+            if (decompressInMemory(data) != test.data) {
+                throw std::runtime_error("round trip failed");
+            }
+            if (treeWalkDecode(data) != test.data) {
+                throw std::runtime_error("walking the tree decodes something else");
+            }
+
+            writeWholeFile(SELF_TEST_OUTPUT, data);
+            decompressFile(SELF_TEST_OUTPUT, SELF_TEST_RESTORED);
+            if (readWholeFile(SELF_TEST_RESTORED) != test.data) {
+                throw std::runtime_error("round trip through a file failed");
+            }
+            for (int i = 0; i < 2; i++) {
+                uint64_t offset = std::uniform_int_distribution<uint64_t>(0, test.data.size())(random);
+                uint64_t length = std::uniform_int_distribution<uint64_t>(0, test.data.size() - offset + 16)(random);
+                if (decodeRange(SELF_TEST_OUTPUT, offset, length) != test.data.substr((size_t) offset, (size_t) length)) {
+                    throw std::runtime_error("range " + std::to_string(offset) + "+" + std::to_string(length) +
+                                             " differs from the whole file");
+                }
+            }
+
+            vector<uint8_t> compressed(compressBound(test.data.size()));
+            size_t compressedSize = compress((const uint8_t *) test.data.data(), test.data.size(), compressed.data(),
+                                             compressed.size(), level);
+            string restored((size_t) decompressedSize(compressed.data(), compressedSize), '\0');
+            decompress(compressed.data(), compressedSize, (uint8_t *) &restored[0], restored.size());
+            if (restored != test.data) {
+                throw std::runtime_error("round trip through compress() failed");
+            }
+            // A buffer with nothing to spare leaves the encoder no room for its longest codes, so it has to
+            // measure them first
+            vector<uint8_t> exact(compressedSize);
+            if (compress((const uint8_t *) test.data.data(), test.data.size(), exact.data(), exact.size(), level) !=
+                    compressedSize || !std::equal(exact.begin(), exact.end(), compressed.begin())) {
+                throw std::runtime_error("compress() into a buffer of just the right size came out different");
+            }
+
+            // Each level's context lives on from one input to the next, so every call runs on what the calls
+            // before it left behind
+            static std::unique_ptr<HuffContext> contexts[9];
+            if (!contexts[level - 1]) {
+                contexts[level - 1].reset(new HuffContext(level));
+            }
+            compressedSize = contexts[level - 1]->compress((const uint8_t *) test.data.data(), test.data.size(),
+                                                           compressed.data(), compressed.size());
+            std::fill(restored.begin(), restored.end(), '\0');
+            contexts[level - 1]->decompress(compressed.data(), compressedSize, (uint8_t *) &restored[0], restored.size());
+            if (restored != test.data) {
+                throw std::runtime_error("round trip through a HuffContext failed");
+            }
+        } catch (const std::exception &e) {
+            cout << "  " << where << ": " << e.what() << endl;
+            failures++;
+            continue;
+        }
+
+        for (int i = 0; i < SELF_TEST_CORRUPTIONS; i++) {
+            string damaged = data;
+            int changes = std::uniform_int_distribution<int>(1, 4)(random);
+            for (int k = 0; k < changes; k++) {
+                // Half the damage lands near the start, where the header and table are
+                size_t limit = k % 2 == 0 ? std::min<size_t>(damaged.size(), 600) : damaged.size();
+                size_t position = std::uniform_int_distribution<size_t>(0, limit - 1)(random);
+                damaged[position] = (char) std::uniform_int_distribution<int>(0, 255)(random);
+            }
+            if (i == SELF_TEST_CORRUPTIONS - 1) {
+                damaged.resize(std::uniform_int_distribution<size_t>(0, damaged.size() - 1)(random));
+            }
+            try {
+                // Every other copy goes through a file, which takes another way through the decoder
+                if (i % 2 == 0) {
+                    decompressInMemory(damaged);
+                } else {
+                    writeWholeFile(SELF_TEST_OUTPUT, damaged);
+                    decompressFile(SELF_TEST_OUTPUT, SELF_TEST_RESTORED);
+                }
+            } catch (const std::runtime_error &) {
+            } catch (const std::exception &e) {
+                cout << "  " << where << ": damaged copy threw " << e.what() << endl;
+                failures++;
+            }
+        }
+    }
+
+    fileInfo.fileStream.close();
+    return failures;
+}
+
+//Seconds a plain loop takes to count the bytes of data: what this machine and build do with a byte at a time,
+//for the performance gate to measure the codec against
+double referenceSeconds(const string &data) {
+    vector<uint64_t> counts(256);
+    Stopwatch::time_point start = Stopwatch::now();
+    for (char byte : data) {
+        counts[(unsigned char) byte]++;
+    }
+    double seconds = secondsSince(start);
+    // Keeps the loop from being optimized away
+    volatile uint64_t sink = counts[0];
+    (void) sink;
+    return seconds;
+}
+
+// Encode and decode speed for each level the performance gate times, as multiples of the reference loop's
+typedef map<int, std::pair<double, double>> PerfFigures;
+
+//Times compression and decompression of test at PERF_GATE_LEVELS, best of PERF_GATE_RUNS each, as multiples of
+//the reference loop's speed (see referenceSeconds, timed alongside every run so that both see the same load on
+//the machine). The reference speed goes in reference.
+PerfFigures measurePerf(const SelfTestCase &test, double &reference) {
+    writeWholeFile(SELF_TEST_INPUT, test.data);
+    FileInfo fileInfo;
+    fileInfo.fileName = SELF_TEST_INPUT;
+    fileInfo.fileNameLength = fileInfo.fileName.length();
+    loadFileContents(fileInfo);
+
+    PerfFigures measured;
+    double bestReferenceSeconds = referenceSeconds(test.data);
+    for (int level : PERF_GATE_LEVELS) {
+        applyCompressionLevel(fileInfo, level);
+        double encodeSeconds = 0, decodeSeconds = 0;
+        for (int i = 0; i < PERF_GATE_RUNS; i++) {
+            Stopwatch::time_point start = Stopwatch::now();
+            string data = compressInMemory(fileInfo);
+            double seconds = secondsSince(start);
+            encodeSeconds = i == 0 ? seconds : std::min(encodeSeconds, seconds);
+
+            start = Stopwatch::now();
+            string decoded = decompressInMemory(data);
+            seconds = secondsSince(start);
+            decodeSeconds = i == 0 ? seconds : std::min(decodeSeconds, seconds);
+            if (decoded != test.data) {
+                throw std::runtime_error("round trip failed at level " + std::to_string(level));
+            }
+            bestReferenceSeconds = std::min(bestReferenceSeconds, referenceSeconds(test.data));
+        }
+        measured[level] = std::make_pair(megabytesPerSecond((double) test.data.size(), encodeSeconds),
+                                         megabytesPerSecond((double) test.data.size(), decodeSeconds));
+    }
+    fileInfo.fileStream.close();
+    reference = megabytesPerSecond((double) test.data.size(), bestReferenceSeconds);
+    for (auto &level : measured) {
+        level.second.first /= reference;
+        level.second.second /= reference;
+    }
+    return measured;
+}
+
+//Times a fixed input (see measurePerf) and compares the figures with the baseline file, or with writeBaseline
+//writes them to it. A run that comes out too slow is timed again, and only the second one counts, so a moment
+//of load on the machine doesn't fail the gate. A missing baseline is a failure, so a gate pointed at the wrong
+//file can't pass by writing itself a new one. Returns how many figures fell more than PERF_GATE_TOLERANCE
+//below the baseline.
+int perfGate(const string &baselineName, bool writeBaseline) {
+    std::mt19937 random(1);
+    SelfTestCase test = {"perf gate", randomBytes(random, 1 << 22, 96, 1.05, 2)};
+    double reference;
+    PerfFigures measured = measurePerf(test, reference);
+
+    if (writeBaseline) {
+        ofstream fout(baselineName);
+        for (const auto &level : measured) {
+            fout << level.first << " " << level.second.first << " " << level.second.second << endl;
+        }
+        if (!fout) {
+            throw std::runtime_error("could not write " + baselineName);
+        }
+        cout << "Wrote the baseline to " << baselineName << endl;
+        return 0;
+    }
+
+    // A line for each level: the level, then its encode and decode figures. Lines starting with # are notes.
+    ifstream fin(baselineName);
+    if (!fin) {
+        cout << "  no baseline in " << baselineName << ", -w writes one" << endl;
+        return 1;
+    }
+    PerfFigures baseline;
+    string line;
+    while (getline(fin, line)) {
+        int level;
+        double encode, decode;
+        std::istringstream fields(line);
+        if (!line.empty() && line[0] != '#' && fields >> level >> encode >> decode && measured.count(level) > 0) {
+            baseline[level] = std::make_pair(encode, decode);
+        }
+    }
+    if (baseline.empty()) {
+        cout << "  no figures for the levels timed in " << baselineName << endl;
+        return 1;
+    }
+
+    int failures = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt > 0) {
+            cout << "  timing again" << endl;
+            measured = measurePerf(test, reference);
+        }
+        failures = 0;
+        cout << std::setprecision(1) << std::fixed << "  reference loop " << reference << " MB/s" << endl;
+        cout << std::setprecision(3);
+        for (const auto &level : baseline) {
+            double expected[2] = {level.second.first, level.second.second};
+            double current[2] = {measured[level.first].first, measured[level.first].second};
+            for (int side = 0; side < 2; side++) {
+                bool slower = current[side] < expected[side] * (1 - PERF_GATE_TOLERANCE);
+                cout << "  level " << level.first << (side == 0 ? " encode " : " decode ") << std::setw(7)
+                     << current[side] << " x the reference, baseline " << std::setw(7) << expected[side]
+                     << (slower ? "  TOO SLOW" : "") << endl;
+                failures += slower ? 1 : 0;
+            }
+        }
+        if (failures == 0) {
+            break;
+        }
+    }
+    return failures;
+}
+
+//Reads a file a piece at a time for its size and CRC32C
+void sizeAndChecksum(const string &fileName, uint64_t &size, uint32_t &checksum) {
+    ifstream fin(fileName, ios::in | ios::binary);
+    if (!fin) {
+        throw std::runtime_error("could not open " + fileName);
+    }
+    vector<char> buffer(1 << 20);
+    uint32_t crc = CRC32C_INITIAL;
+    size = 0;
+    while (fin.read(buffer.data(), buffer.size()) || fin.gcount() > 0) {
+        crc = crc32cUpdate(crc, buffer.data(), (size_t) fin.gcount());
+        size += (uint64_t) fin.gcount();
+    }
+    checksum = ~crc;
+}
+
+//Makes the large test file (see LARGE_TEST_SIZE), compresses it as huff does, restores it, and compares the
+//copy's size and CRC32C with the original's. The stretch across 4 GiB is also read back through the seek
+//index. Prints what went wrong and returns how many things did.
+int largeFileTest(std::mt19937 &random) {
+    const uint64_t stretchStarts[] = {0, ((uint64_t) 1 << 31) - LARGE_TEST_STRETCH / 2,
+                                      ((uint64_t) 1 << 32) - LARGE_TEST_STRETCH / 2, LARGE_TEST_SIZE - LARGE_TEST_STRETCH};
+    vector<string> stretches;
+    int failures = 0;
+    try {
+        ofstream fout(LARGE_TEST_INPUT, ios::out | ios::binary | ios::trunc);
+        for (uint64_t start : stretchStarts) {
+            stretches.push_back(randomBytes(random, LARGE_TEST_STRETCH, 96, 1.05, 2));
+            fout.seekp((std::streamoff) start);
+            fout.write(stretches.back().data(), stretches.back().size());
+        }
+        fout.close();
+        if (!fout) {
+            throw std::runtime_error(string("could not write ") + LARGE_TEST_INPUT);
+        }
+
+        FileInfo fileInfo;
+        fileInfo.fileName = LARGE_TEST_INPUT;
+        fileInfo.fileNameLength = fileInfo.fileName.length();
+        applyCompressionLevel(fileInfo, DEFAULT_COMPRESSION_LEVEL);
+        compressFile(fileInfo);
+        decompressFile(LARGE_TEST_OUTPUT, LARGE_TEST_RESTORED);
+
+        uint64_t originalSize, restoredSize;
+        uint32_t originalChecksum, restoredChecksum;
+        sizeAndChecksum(LARGE_TEST_INPUT, originalSize, originalChecksum);
+        sizeAndChecksum(LARGE_TEST_RESTORED, restoredSize, restoredChecksum);
+        if (originalSize != LARGE_TEST_SIZE || restoredSize != originalSize) {
+            throw std::runtime_error("made " + std::to_string(originalSize) + " bytes, restored " +
+                                     std::to_string(restoredSize));
+        }
+        if (restoredChecksum != originalChecksum) {
+            throw std::runtime_error("the restored copy has another CRC32C");
+        }
+        if (decodeRange(LARGE_TEST_OUTPUT, stretchStarts[2], LARGE_TEST_STRETCH) != stretches[2]) {
+            throw std::runtime_error("the range across 4 GiB decodes to something else");
+        }
+    } catch (const std::exception &e) {
+        cout << "  " << LARGE_TEST_INPUT << ": " << e.what() << endl;
+        failures++;
+    }
+    std::remove(LARGE_TEST_INPUT);
+    std::remove(LARGE_TEST_OUTPUT);
+    std::remove(LARGE_TEST_RESTORED);
+    cout << "A sparse file of " << LARGE_TEST_SIZE << " bytes: "
+         << (failures == 0 ? "round trip passed" : "round trip failed") << endl;
+    return failures;
+}
+
+//Round trips the self test inputs at every level, decodes the fixtures in fixtureDirectory when there is one,
+//then runs the performance gate when there's a baseline file to hold it to (or to write, with writeBaseline).
+//With gateOnly, just the gate runs. seed picks the random inputs, so a failure can be repeated. Returns how
+//many checks failed.
+int selfTest(unsigned seed, const string &fixtureDirectory, const string &baselineName, bool writeBaseline,
+             bool gateOnly) {
+    int failures = 0;
+    if (!gateOnly) {
+        std::mt19937 random(seed);
+        vector<SelfTestCase> cases = selfTestCases(random);
+        for (size_t i = 0; i < cases.size(); i++) {
+            failures += selfTestCase(cases[i], random, cases[i].name.compare(0, 6, "random") == 0);
+        }
+        cout << cases.size() << " inputs at every level, seed " << seed << ": "
+             << (failures == 0 ? "all round trips passed" : std::to_string(failures) + " failures") << endl;
+    }
+
+    if (!gateOnly && !fixtureDirectory.empty()) {
+        failures += checkFixtures(fixtureDirectory);
+    }
+    if (!baselineName.empty()) {
+        failures += perfGate(baselineName, writeBaseline);
+    }
+    std::remove(SELF_TEST_INPUT);
+    std::remove(SELF_TEST_OUTPUT);
+    std::remove(SELF_TEST_RESTORED);
+    return failures;
+}
+
+const char *const SELF_TEST_USAGE = "usage: huff_selftest [-r seed] [-f fixtureDirectory] [-w] [-g] [baseline]\n"
+                                    "       huff_selftest -l";
+
+//Usage:
+//  huff_selftest [-r seed] [-f fixtureDirectory] [-w] [-g] [baseline]
+//  huff_selftest -l
+//-r picks the random inputs, -f is where the version 1 fixtures are (the test directory of the source tree),
+//and the baseline file holds the speeds the performance gate compares with; -w writes it from this run instead,
+//and -g runs the gate alone. -l runs just the large file test, which needs a few GB of disk in the current
+//directory.
+int main(int argc, char *argv[]) {
+    unsigned seed = 1;
+    string fixtureDirectory;
+    string baselineName;
+    bool writeBaseline = false;
+    bool gateOnly = false;
+    bool large = false;
+    for (int arg = 1; arg < argc; arg++) {
+        string option = argv[arg];
+        if (option == "-r" && arg + 1 < argc) {
+            seed = (unsigned) std::strtoul(argv[++arg], nullptr, 10);
+        } else if (option == "-f" && arg + 1 < argc) {
+            fixtureDirectory = argv[++arg];
+        } else if (option == "-w") {
+            writeBaseline = true;
+        } else if (option == "-g") {
+            gateOnly = true;
+        } else if (option == "-l") {
+            large = true;
+        } else if (option[0] != '-' && baselineName.empty()) {
+            baselineName = option;
+        } else {
+            cerr << SELF_TEST_USAGE << endl;
+            return 1;
+        }
+    }
+    if ((writeBaseline || gateOnly) && baselineName.empty()) {
+        cerr << SELF_TEST_USAGE << endl;
+        return 1;
+    }
+
+    try {
+        if (large) {
+            std::mt19937 random(seed);
+            return largeFileTest(random) == 0 ? 0 : 1;
+        }
+        return selfTest(seed, fixtureDirectory, baselineName, writeBaseline, gateOnly) == 0 ? 0 : 1;
+    } catch (const std::runtime_error &e) {
+        cerr << "self test: " << e.what() << endl;
+        return 1;
+    }
+}